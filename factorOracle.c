@@ -32,6 +32,23 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 
 
@@ -39,6 +56,9 @@
 static t_class *proxy_class = NULL;
 static t_class *fopenpanel_class = NULL;
 static t_class *factorOracle_class = NULL;
+static t_class *factorOracle_tilde_class = NULL;
+static t_class *sharedoracle_class = NULL;
+static uint64_t instance_count = 0;
 
 
 
@@ -61,13 +81,234 @@ typedef struct _fopenpanel
 
 
 
-typedef struct _state
+// State indices and input symbols are stored as 32-bit integers, which covers every integer a Pd float
+// holds exactly. Build with -DFACTORORACLE_INDEX_64 for oracles of more than 2^31 states.
+#ifdef FACTORORACLE_INDEX_64
+typedef int64_t t_foindex;
+#define FOINDEX_MIN INT64_MIN
+#define FOINDEX_MAX INT64_MAX
+#else
+typedef int32_t t_foindex;
+#define FOINDEX_MIN INT32_MIN
+#define FOINDEX_MAX INT32_MAX
+#endif
+
+
+
+
+// An arena block is named by a 32-bit handle: the chunk number in the high bits and the offset into
+// the chunk, in 8-byte units, in the low ARENA_OFFSET_BITS. Offsets reach ARENA_MAX_CHUNK_SIZE, so a
+// block larger than that, such as the transitions of a state with tens of thousands of edges or a large
+// -alphabet table, gets a chunk of its own and starts at offset 0.
+typedef uint32_t t_arenahandle;
+
+#define ARENA_NULL UINT32_MAX
+#define ARENA_SIZE_CLASSES 48
+#define ARENA_OFFSET_BITS 17
+#define ARENA_MAX_CHUNKS ((1L << (32 - ARENA_OFFSET_BITS)) - 1)
+#define ARENA_FIRST_CHUNK_SIZE 16384
+#define ARENA_MAX_CHUNK_SIZE ((size_t)8 << ARENA_OFFSET_BITS)
+#define TRANSITION_INDEX_MIN 8
+#define STATE_PAGE_SHIFT 10
+#define STATE_PAGE_SIZE (1L << STATE_PAGE_SHIFT)
+#define STATE_PAGE_MASK (STATE_PAGE_SIZE - 1)
+#define LOAD_POLL_INTERVAL 5
+#define WINDOW_CATCHUP 256
+#define INTERN_EVENT_MAX 64
+#define FRAME_LANES 8
+#define FRAME_ALIGN 32
+#define SIGNAL_INPUT_RING 4096
+#define GENERATE_MAX 1048576
+#define SIGNAL_OUTPUT_RING 64
+#define SIGNAL_POLL_INTERVAL 1
+#define SIGNAL_IDLE_TICKS 100
+#define STATE_INPUTS 0x01
+#define STATE_INDEX 0x02
+#define STATE_COUNT 0x04
+#define STATE_SYMBOLS 0x08
+#define STATE_TARGETS 0x10
+#define STATE_LINK 0x20
+#define STATE_ALL 0x3f
+
+typedef struct _arenachunk
 {
-    long suffixLink;
-    long numberOfTransitionElements;
-    long transitionElement;
-    long *transitionEndStates;
-} t_state;
+    char *base;
+    size_t size;
+} t_arenachunk;
+
+typedef struct _arena
+{
+    t_arenachunk *chunks;
+    long chunk_count;
+    long chunk_limit;
+    long current;
+    size_t used;
+    long borrowed;
+    t_arenahandle free_list[ARENA_SIZE_CLASSES];
+} t_arena;
+
+
+
+
+// States are kept as parallel arrays per page, so walks along suffix links only touch suffixLink[].
+typedef struct _statepage
+{
+    t_foindex suffixLink[STATE_PAGE_SIZE];
+    t_foindex symbol[STATE_PAGE_SIZE];
+    t_arenahandle edgeOffset[STATE_PAGE_SIZE];
+    t_foindex edgeCount[STATE_PAGE_SIZE];
+    t_foindex farLink[STATE_PAGE_SIZE];
+    t_foindex lrs[STATE_PAGE_SIZE];
+    t_foindex firstChild[STATE_PAGE_SIZE];
+    t_foindex nextSibling[STATE_PAGE_SIZE];
+} t_statepage;
+
+#define STATE(o, field, i) ((o)->state_pages[(i) >> STATE_PAGE_SHIFT]->field[(i) & STATE_PAGE_MASK])
+
+
+
+
+// xoshiro256** generator, one per object, so that oracles neither share nor reseed each other's sequence.
+typedef struct _rng
+{
+    uint64_t s[4];
+} t_rng;
+
+
+
+
+// Maps each distinct event, a float, a symbol or a list of them, to a dense id 0..count-1 used as the
+// symbol of the oracle. The events are stored back to back in atoms, event id starting at offsets[id],
+// and index is an open-addressing table of 2 * limit slots holding id + 1.
+typedef struct _interner
+{
+    t_atom *atoms;
+    long atom_count;
+    long atom_limit;
+    long *offsets;
+    long count;
+    long limit;
+    t_foindex *index;
+} t_interner;
+
+
+
+
+// The graph itself. An object points to its oracle, so that a new one can be built away from the Pd
+// thread and swapped in whole.
+typedef struct _oracle
+{
+    t_statepage **state_pages;
+    long state_page_count;
+    long state_page_limit;
+    t_arena arena;
+    long input_index;
+    long dense_alphabet_size;
+    t_foindex *alphabet;
+    long *alphabet_counts;
+    long alphabet_size;
+    long alphabet_limit;
+    t_foindex *alphabet_index;
+    t_interner *interner;
+    float *frames;
+    char *frame_block;
+    long frame_dim;
+    long frame_stride;
+    long frame_limit;
+    float frame_threshold;
+    char *snapshot;
+    size_t snapshot_size;
+    long snapshot_pages;
+} t_oracle;
+
+
+
+
+// A read, or a rebuild of the window, running on a worker thread. The worker only touches the job; the
+// Pd thread polls done from a clock and swaps the finished oracle in, so the current one keeps playing
+// until then.
+typedef struct _loadjob
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    FILE *file;
+    t_foindex *symbols;
+    long symbol_count;
+    long first;
+    t_oracle *oracle;
+    long total;
+    long skipped;
+    int failed;
+    int done;
+    int cancel;
+} t_loadjob;
+
+
+
+
+// An oracle created with -name, bound to that name the way [value] binds its cell. The first object to
+// use the name writes the oracle and the others only walk it; when the writer goes, the oldest of the
+// others takes over.
+typedef struct _sharedoracle
+{
+    t_pd s_pd;
+    t_symbol *name;
+    t_oracle *oracle;
+    struct _factorOracle *users;
+    long refcount;
+} t_sharedoracle;
+
+
+
+
+// A walker over the oracle. Voices share the graph and the navigation mode, but each has its own place
+// in it, probability and generator.
+typedef struct _voice
+{
+    long output_state;
+    long jump_pending;
+    double probability;
+    t_rng rng;
+} t_voice;
+
+
+
+
+// A single-producer single-consumer ring of samples. Only the producer moves head and only the consumer
+// moves tail; each reads the other's index with acquire and publishes its own with release, so neither
+// side ever waits or allocates.
+typedef struct _ring
+{
+    t_sample *values;
+    long mask;
+    long head;
+    long tail;
+} t_ring;
+
+
+
+
+// The signal side of [factorOracle~]. The DSP routine pushes the input value at each onset into input
+// and plays output; a clock on the control side builds the oracle from input and keeps output topped up
+// with symbols generated by a voice of its own, so perform never allocates or walks the oracle. When the
+// oracle changes, the control side sets discard to the head of output, and perform drops everything
+// queued before it. The clock is started by the dsp method and stops once perform has not run for
+// SIGNAL_IDLE_TICKS ticks, so nothing is polled while DSP is off.
+typedef struct _signalio
+{
+    t_ring input;
+    t_ring output;
+    long discard;
+    t_voice voice;
+    t_clock *clock;
+    long blocks;
+    long last_blocks;
+    long idle_ticks;
+    t_sample last_onset;
+    t_sample last_play;
+    t_sample current;
+    long dropped;
+} t_signalio;
 
 
 
@@ -75,6 +316,8 @@ typedef struct _state
 typedef struct _factorOracle
 {
     t_object x_obj;
+    t_float signal_f;
+    t_signalio *dsp;
     
     t_canvas *canvas;
     t_symbol *canvas_dir;
@@ -88,23 +331,34 @@ typedef struct _factorOracle
     t_outlet *m_outlet4;
     t_outlet *m_outlet5;
     t_outlet *m_outlet6;
+    t_outlet *m_outlet7;
     t_outlet *m_outlet10;
     
-    long *alphabet;
-    long alphabet_size;
-    char *json;
-    long json_size;
-    t_state *states;
-    long *input_string;
-    long input_limit;
-    long input_index;
-    long output_state;
-    long *output_string;
-    long output_limit;
-    long output_index;
+    t_oracle *oracle;
+    t_sharedoracle *shared;
+    struct _factorOracle *next_user;
+    t_loadjob *load;
+    t_clock *load_clock;
+    long window;
+    long window_dropped;
+    t_voice *voices;
+    long voice_count;
+    t_atom *generated;
+    long generated_size;
     long default_size;
-    double probability;
+    long dense_alphabet_size;
+    int intern;
+    long frame_dim;
+    float frame_threshold;
+    t_atom *frame_atoms;
+    long frame_atoms_size;
+    double forward_weight;
     long mode;
+    long min_context;
+    t_atom *contexts;
+    long contexts_size;
+    t_atom *state_atoms;
+    long state_atoms_size;
     long previousRoute;
 } t_factorOracle;
 
@@ -118,28 +372,397 @@ static const char *EMPTY_ORACLE_ERROR = "The oracle is empty.";
 
 
 void *factorOracle_new(t_symbol *s, int argc, t_atom *argv);
+void *factorOracle_tilde_new(t_symbol *s, int argc, t_atom *argv);
+static void *newObject(t_class *c, int argc, t_atom *argv);
+static void addMethods(t_class *c);
+void factorOracle_tilde_dsp(t_factorOracle *x, t_signal **sp);
+void factorOracle_tilde_tick(t_factorOracle *x);
+static t_signalio *signalio_new(t_factorOracle *x);
+static void signalio_free(t_signalio *d);
+static void flushSignal(t_factorOracle *x);
+int parseCreationFlags(t_factorOracle *x, int argc, t_atom *argv, t_atom *positional, t_symbol **name);
 void factorOracle_free(t_factorOracle *x);
 void factorOracle_bang(t_factorOracle *x);
+void factorOracle_generate(t_factorOracle *x, t_floatarg steps, t_floatarg with_states);
 void factorOracle_float(t_factorOracle *x, float transition);
-void factorOracle_state(t_factorOracle *x, float state);
+void factorOracle_list(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
+void factorOracle_add(t_factorOracle *x, t_symbol *s);
+void factorOracle_state(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
+void factorOracle_step(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
+void factorOracle_voices(t_factorOracle *x, t_floatarg count);
+t_voice *voiceAt(t_factorOracle *x, long voice);
+int setVoices(t_factorOracle *x, long count);
 void factorOracle_mode(t_factorOracle *x, float mode);
-void factorOracle_probability(t_factorOracle *x, float probability);
+void factorOracle_probability(t_factorOracle *x, t_floatarg probability, t_floatarg voice);
+void factorOracle_seed(t_factorOracle *x, t_floatarg seed, t_floatarg voice);
+void factorOracle_forward(t_factorOracle *x, t_floatarg weight);
+void factorOracle_context(t_factorOracle *x, t_floatarg length);
+void factorOracle_truncate(t_factorOracle *x, t_floatarg length);
+void factorOracle_window(t_factorOracle *x, t_floatarg size);
+void truncateOracle(t_oracle *o, long length);
+void removeLastTransition(t_oracle *o, long k);
+void factorOracle_contexts(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
+long contexts(t_factorOracle *x, long state, long min_length);
+void factorOracle_find(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
+long findPattern(t_factorOracle *x, const t_atom *pattern, long m);
+long findOccurrences(t_factorOracle *x, long reached, const t_atom *pattern, long m);
+long lengthCommonSuffix(t_oracle *o, long p1, long p2);
+void factorOracle_jumpback(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
+long jumpBack(t_factorOracle *x, long stateIndex);
+long chooseEdge(t_factorOracle *x, t_voice *v, long k);
 void factorOracle_clear(t_factorOracle *x);
 void factorOracle_anything(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
-long factorOracle_walk(t_factorOracle *x);
+long factorOracle_walk(t_factorOracle *x, t_voice *v);
 void factorOracle_doread(t_factorOracle *x, t_symbol *s);
 void factorOracle_alphabet(t_factorOracle *x);
 void factorOracle_dowrite(t_factorOracle *x, t_symbol *s);
-long memberOfTransitionElements(long transition, long k, t_factorOracle *x);
-long buildOracle(long transition, t_factorOracle *x);
-int getInputString(t_factorOracle *x);
-void setState(t_factorOracle *x, long state_index);
-void getState(t_factorOracle *x);
-long getAlphabet(t_factorOracle *x);
-long json(t_factorOracle *x);
-long mode_0(t_factorOracle *x);
-long mode_1(t_factorOracle *x);
-long mode_2(t_factorOracle *x);
+void factorOracle_save(t_factorOracle *x, t_symbol *s);
+void factorOracle_load(t_factorOracle *x, t_symbol *s);
+t_oracle *oracle_new(long dense_alphabet_size);
+void oracle_free(t_oracle *o);
+int countSymbol(t_oracle *o, long transition);
+void uncountSymbol(t_oracle *o, long transition);
+void resetAlphabet(t_oracle *o);
+long symbolCount(t_oracle *o, long transition);
+t_interner *interner_new(void);
+void interner_free(t_interner *t);
+void interner_reset(t_interner *t);
+long internEvent(t_interner *t, const t_atom *event, long n, long max_count);
+long lookupEvent(const t_interner *t, const t_atom *event, long n);
+static long nearestFrame(t_oracle *o, long k, long transition);
+int reserveFrames(t_oracle *o, long count);
+void addFrames(t_factorOracle *x, const t_atom *atoms, const t_word *words, long count);
+void factorOracle_threshold(t_factorOracle *x, t_floatarg threshold);
+void factorOracle_symbol(t_factorOracle *x, t_symbol *s);
+void addEvent(t_factorOracle *x, const t_atom *event, long n);
+void factorOracle_alphabet(t_factorOracle *x);
+void factorOracle_histogram(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv);
+t_oracle *shareOracle(t_factorOracle *x, t_symbol *name);
+void unshareOracle(t_factorOracle *x);
+void swapOracle(t_factorOracle *x, t_oracle *o);
+void factorOracle_loaded(t_factorOracle *x);
+static void cancelLoad(t_factorOracle *x);
+static void cancelWindow(t_factorOracle *x);
+static void slideWindow(t_factorOracle *x);
+static int windowFull(t_factorOracle *x);
+static void finishLoad(t_factorOracle *x);
+static t_factorOracle *oracleUsers(t_factorOracle *x);
+static int canWrite(t_factorOracle *x);
+static void outputEvent(t_factorOracle *x, long id);
+static void outputEvents(t_factorOracle *x, t_atom *symbols, long count);
+long memberOfTransitionElements(long transition, long k, t_oracle *o);
+long transitionCapacity(long n);
+t_foindex *transitionEndStates(t_oracle *o, long k);
+t_foindex *transitionSymbols(t_oracle *o, long k);
+long appendTransition(t_oracle *o, long k, long end_state, long transition);
+long buildOracle(long transition, t_oracle *o);
+int reserveStates(t_oracle *o, long count);
+int validTransition(t_factorOracle *x, long transition);
+long addTransitions(t_factorOracle *x, const t_atom *atoms, const t_word *words, long count);
+void setState(t_factorOracle *x, long voice, long state_index);
+void getState(t_factorOracle *x, unsigned fields);
+static int reserveAtoms(t_atom **atoms, long *size, long count);
+static void takeAtoms(t_atom **scratch, long *scratch_size, t_atom **atoms, long *size);
+static void returnAtoms(t_atom **scratch, long *scratch_size, t_atom *atoms, long size);
+static void outputReply(t_factorOracle *x, const char *selector, long count);
+long json(t_factorOracle *x, t_symbol *s);
+void factorOracle_json(t_factorOracle *x, t_symbol *s);
+long mode_0(t_factorOracle *x, t_voice *v);
+long mode_1(t_factorOracle *x, t_voice *v);
+long mode_2(t_factorOracle *x, t_voice *v);
+
+
+
+
+// States are stored in fixed-size pages that are allocated on demand, so the oracle grows without an
+// upper limit and without ever moving what it already holds. Only the page directory is reallocated,
+// and it holds one pointer per STATE_PAGE_SIZE entries.
+static int reservePages(void ***pages, long *page_count, long *page_limit, size_t page_bytes, long count)
+{
+    long needed = (count + STATE_PAGE_SIZE - 1) >> STATE_PAGE_SHIFT;
+    if (needed > *page_limit)
+    {
+        long limit = (*page_limit > 0) ? *page_limit : 4;
+        while (limit < needed)
+        {
+            limit *= 2;
+        }
+        void **grown = resizebytes(*pages, *page_limit * sizeof(void *), limit * sizeof(void *));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        *pages = grown;
+        *page_limit = limit;
+    }
+    
+    while (*page_count < needed)
+    {
+        void *page = getbytes(page_bytes);
+        if (page == NULL)
+        {
+            return -1;
+        }
+        (*pages)[(*page_count)++] = page;
+    }
+    return 0;
+}
+
+
+
+
+// Pages [0, borrowed) are not owned, they live in a loaded snapshot.
+static void freePages(void ***pages, long *page_count, long *page_limit, size_t page_bytes, long borrowed)
+{
+    for (long i = borrowed; i < *page_count; i++)
+    {
+        freebytes((*pages)[i], page_bytes);
+    }
+    freebytes(*pages, *page_limit * sizeof(void *));
+    *pages = NULL;
+    *page_count = 0;
+    *page_limit = 0;
+}
+
+
+
+
+// Makes sure states [0, count) exist.
+int reserveStates(t_oracle *o, long count)
+{
+    if (count <= (o->state_page_count << STATE_PAGE_SHIFT))
+    {
+        return 0;
+    }
+    return reservePages((void ***)&o->state_pages, &o->state_page_count, &o->state_page_limit, sizeof(t_statepage), count);
+}
+
+
+
+
+// Blocks are handed out in power-of-two byte sizes of at least 8; the size class is the exponent.
+static int arena_size_class(size_t bytes)
+{
+    int size_class = 3;
+    while (((size_t)1 << size_class) < bytes)
+    {
+        size_class++;
+    }
+    return size_class;
+}
+
+
+
+
+static void *arena_pointer(t_arena *a, t_arenahandle h)
+{
+    return a->chunks[h >> ARENA_OFFSET_BITS].base + ((size_t)(h & ((1 << ARENA_OFFSET_BITS) - 1)) << 3);
+}
+
+
+
+
+static void arena_init(t_arena *a)
+{
+    a->chunks = NULL;
+    a->chunk_count = 0;
+    a->chunk_limit = 0;
+    a->current = 0;
+    a->used = 0;
+    a->borrowed = 0;
+    for (int i = 0; i < ARENA_SIZE_CLASSES; i++)
+    {
+        a->free_list[i] = ARENA_NULL;
+    }
+}
+
+
+
+
+static t_arenahandle arena_alloc(t_arena *a, size_t bytes)
+{
+    int size_class = arena_size_class(bytes);
+    t_arenahandle block = a->free_list[size_class];
+    if (block != ARENA_NULL)
+    {
+        a->free_list[size_class] = *(t_arenahandle *)arena_pointer(a, block);
+        return block;
+    }
+    
+    bytes = (size_t)1 << size_class;
+    while (a->current >= a->chunk_count || a->used >= ARENA_MAX_CHUNK_SIZE || a->used + bytes > a->chunks[a->current].size
+           || (bytes > ARENA_MAX_CHUNK_SIZE && a->used > 0))
+    {
+        if (a->current + 1 < a->chunk_count)
+        {
+            // Chunks are kept across arena_reset(), so reuse them before asking for more.
+            a->current++;
+            a->used = 0;
+            continue;
+        }
+        
+        if (a->chunk_count >= ARENA_MAX_CHUNKS)
+        {
+            return ARENA_NULL;
+        }
+        if (a->chunk_count == a->chunk_limit)
+        {
+            long limit = (a->chunk_limit > 0) ? 2 * a->chunk_limit : 8;
+            t_arenachunk *grown = resizebytes(a->chunks, a->chunk_limit * sizeof(t_arenachunk), limit * sizeof(t_arenachunk));
+            if (grown == NULL)
+            {
+                return ARENA_NULL;
+            }
+            a->chunks = grown;
+            a->chunk_limit = limit;
+        }
+        
+        size_t size = (a->chunk_count == 0) ? ARENA_FIRST_CHUNK_SIZE : a->chunks[a->chunk_count - 1].size * 2;
+        if (size > ARENA_MAX_CHUNK_SIZE)
+        {
+            size = ARENA_MAX_CHUNK_SIZE;
+        }
+        if (size < bytes)
+        {
+            size = bytes;
+        }
+        
+        char *base = getbytes(size);
+        if (base == NULL)
+        {
+            return ARENA_NULL;
+        }
+        a->chunks[a->chunk_count].base = base;
+        a->chunks[a->chunk_count].size = size;
+        a->current = a->chunk_count++;
+        a->used = 0;
+    }
+    
+    block = ((t_arenahandle)a->current << ARENA_OFFSET_BITS) | (t_arenahandle)(a->used >> 3);
+    a->used += bytes;
+    return block;
+}
+
+
+
+
+static void arena_release(t_arena *a, t_arenahandle block, size_t bytes)
+{
+    int size_class = arena_size_class(bytes);
+    *(t_arenahandle *)arena_pointer(a, block) = a->free_list[size_class];
+    a->free_list[size_class] = block;
+}
+
+
+
+
+// Gives back the tail of a block that is shrinking from old_bytes to new_bytes, as power-of-two blocks.
+// Pieces of a block larger than a chunk that lie past ARENA_MAX_CHUNK_SIZE have no handle, so they stay
+// unused in the block's chunk until the arena is reset.
+static void arena_shrink(t_arena *a, t_arenahandle block, size_t old_bytes, size_t new_bytes)
+{
+    size_t offset = (size_t)(block & ((1U << ARENA_OFFSET_BITS) - 1)) << 3;
+    size_t size = (size_t)1 << arena_size_class(new_bytes);
+    size_t end = (size_t)1 << arena_size_class(old_bytes);
+    while (size < end && offset + size < ARENA_MAX_CHUNK_SIZE)
+    {
+        arena_release(a, block + (t_arenahandle)(size >> 3), size);
+        size <<= 1;
+    }
+}
+
+
+
+
+static void arena_reset(t_arena *a)
+{
+    a->current = 0;
+    a->used = 0;
+    for (int i = 0; i < ARENA_SIZE_CLASSES; i++)
+    {
+        a->free_list[i] = ARENA_NULL;
+    }
+}
+
+
+
+
+// Chunks [0, borrowed) live in a loaded snapshot and are released with it.
+static void arena_free(t_arena *a)
+{
+    for (long i = a->borrowed; i < a->chunk_count; i++)
+    {
+        freebytes(a->chunks[i].base, a->chunks[i].size);
+    }
+    freebytes(a->chunks, a->chunk_limit * sizeof(t_arenachunk));
+    arena_init(a);
+}
+
+
+
+
+static uint64_t rng_rotl(uint64_t v, int k)
+{
+    return (v << k) | (v >> (64 - k));
+}
+
+
+
+
+// Expands seed into the generator state with splitmix64, which never yields the all-zero state.
+static void rng_seed(t_rng *r, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t z = (seed += UINT64_C(0x9E3779B97F4A7C15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+        r->s[i] = z ^ (z >> 31);
+    }
+}
+
+
+
+
+static uint64_t rng_next(t_rng *r)
+{
+    uint64_t result = rng_rotl(r->s[1] * 5, 7) * 9;
+    uint64_t t = r->s[1] << 17;
+    r->s[2] ^= r->s[0];
+    r->s[3] ^= r->s[1];
+    r->s[1] ^= r->s[2];
+    r->s[0] ^= r->s[3];
+    r->s[2] ^= t;
+    r->s[3] = rng_rotl(r->s[3], 45);
+    return result;
+}
+
+
+
+
+// Uniform in [0, 1).
+static double rng_uniform(t_rng *r)
+{
+    return (double)(rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+
+
+// Uniform in [0, n), by Lemire's multiply-and-reject method.
+static uint32_t rng_below(t_rng *r, uint32_t n)
+{
+    uint64_t m = (rng_next(r) >> 32) * n;
+    if ((uint32_t)m < n)
+    {
+        uint32_t threshold = (uint32_t)(-n) % n;
+        while ((uint32_t)m < threshold)
+        {
+            m = (rng_next(r) >> 32) * n;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
 
 
 
@@ -216,7 +839,7 @@ static void fopenpanel_setup(void)
 static void proxy_bang(t_proxy *x)
 {
     t_factorOracle *fo = (t_factorOracle *)(x->factorOracle);
-    getState(fo);
+    getState(fo, STATE_ALL);
 }
 
 
@@ -225,7 +848,7 @@ static void proxy_bang(t_proxy *x)
 static void proxy_state(t_proxy *x, float state)
 {
     t_factorOracle *fo = (t_factorOracle *)(x->factorOracle);
-    setState(fo, (long)state);
+    setState(fo, 0, (long)state);
 }
 
 
@@ -268,14 +891,106 @@ static void proxy_setup(void) {
 
 
 
+// Copies the positional creation arguments to positional and applies the "-flag value" pairs to x.
+// The name given with -name, if any, is returned in name.
+int parseCreationFlags(t_factorOracle *x, int argc, t_atom *argv, t_atom *positional, t_symbol **name)
+{
+    int count = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        if (argv[i].a_type != A_SYMBOL || atom_getsymbol(argv + i)->s_name[0] != '-')
+        {
+            positional[count++] = argv[i];
+        }
+        else if (atom_getsymbol(argv + i) == gensym("-alphabet"))
+        {
+            if (i + 1 < argc && argv[i + 1].a_type == A_FLOAT && atom_getfloat(argv + i + 1) >= 1)
+            {
+                x->dense_alphabet_size = (long)atom_getfloat(argv + i + 1);
+                post("Dense transition tables enabled for input in [0, %ld).", x->dense_alphabet_size);
+            }
+            else
+            {
+                pd_error((t_object *)x, "-alphabet must be followed by an integer greater than 0.");
+            }
+            i++;
+        }
+        else if (atom_getsymbol(argv + i) == gensym("-audio"))
+        {
+            if (i + 2 < argc && argv[i + 1].a_type == A_FLOAT && atom_getfloat(argv + i + 1) >= 1
+                && argv[i + 2].a_type == A_FLOAT && atom_getfloat(argv + i + 2) >= 0)
+            {
+                x->frame_dim = (long)atom_getfloat(argv + i + 1);
+                x->frame_threshold = atom_getfloat(argv + i + 2);
+            }
+            else
+            {
+                pd_error((t_object *)x, "-audio must be followed by the number of features per frame and a distance threshold.");
+            }
+            i += 2;
+        }
+        else if (atom_getsymbol(argv + i) == gensym("-intern"))
+        {
+            x->intern = 1;
+        }
+        else if (atom_getsymbol(argv + i) == gensym("-name"))
+        {
+            if (i + 1 < argc && argv[i + 1].a_type == A_SYMBOL)
+            {
+                *name = atom_getsymbol(argv + i + 1);
+            }
+            else
+            {
+                pd_error((t_object *)x, "-name must be followed by a name.");
+            }
+            i++;
+        }
+        else
+        {
+            pd_error((t_object *)x, "Unknown flag '%s'.", atom_getsymbol(argv + i)->s_name);
+        }
+    }
+    return count;
+}
+
+
+
+
 void *factorOracle_new(t_symbol *s, int argc, t_atom *argv)
+{
+    return newObject(factorOracle_class, argc, argv);
+}
+
+
+
+
+void *factorOracle_tilde_new(t_symbol *s, int argc, t_atom *argv)
+{
+    return newObject(factorOracle_tilde_class, argc, argv);
+}
+
+
+
+
+// Creates either class. [factorOracle~] has two more signal inlets, onset and play, and a signal outlet
+// to the left of the others.
+static void *newObject(t_class *c, int argc, t_atom *argv)
 {
     t_factorOracle *x = NULL;
     
-    if ((x = (t_factorOracle *)pd_new(factorOracle_class))) {
+    if ((x = (t_factorOracle *)pd_new(c))) {
 
         fopenpanel_init(&x->fopenpanel, x);
         
+        x->dsp = NULL;
+        x->signal_f = 0;
+        if (c == factorOracle_tilde_class)
+        {
+            inlet_new(&x->x_obj, &x->x_obj.ob_pd, &s_signal, &s_signal);
+            inlet_new(&x->x_obj, &x->x_obj.ob_pd, &s_signal, &s_signal);
+            outlet_new(&x->x_obj, &s_signal);
+        }
+        
         proxy_init(&x -> pxy, x);
         inlet_new(&x -> x_obj, &x -> pxy.l_pd, 0, 0);
         
@@ -288,35 +1003,111 @@ void *factorOracle_new(t_symbol *s, int argc, t_atom *argv)
         x->m_outlet3  =  outlet_new(&x->x_obj, &s_float);
         x->m_outlet2  =  outlet_new(&x->x_obj, &s_float);
         x->m_outlet1  =  outlet_new(&x->x_obj, &s_float);
+        x->m_outlet7  =  outlet_new(&x->x_obj, 0);
         
-        x->input_index = 0;
-        x->output_index = 0;
-        x->output_state = -1;
-        x->default_size = 10000;
+        x->generated = NULL;
+        x->generated_size = 0;
+        // With state 0, the default fills exactly one page.
+        x->default_size = STATE_PAGE_SIZE - 1;
         
         x->mode = 0;
-        x->probability = 0.75;
+        x->forward_weight = 1.0;
+        x->min_context = 1;
+        x->contexts = NULL;
+        x->contexts_size = 0;
+        x->state_atoms = NULL;
+        x->state_atoms_size = 0;
+        x->voices = NULL;
+        x->voice_count = 0;
+        x->dense_alphabet_size = 0;
+        x->intern = 0;
+        x->frame_dim = 0;
+        x->frame_threshold = 0;
+        x->frame_atoms = NULL;
+        x->frame_atoms_size = 0;
+        x->oracle = NULL;
+        x->shared = NULL;
+        x->next_user = NULL;
+        x->load = NULL;
+        x->load_clock = clock_new(x, (t_method)factorOracle_loaded);
+        x->window = 0;
+        x->window_dropped = 0;
         x->canvas = canvas_getcurrent();
         x->canvas_dir = canvas_getcurrentdir();
         
-        if (argc >= 1 && ((argv)->a_type == A_FLOAT) && (atom_getfloat(argv) > -1))
+        t_atom *positional = getbytes((argc + 1) * sizeof(t_atom));
+        if (positional == NULL)
         {
-            x->states = getbytes(atom_getfloat(argv+0) * sizeof(t_state));
-            x->input_limit = (long)atom_getfloat(argv+0);
-            x->output_string = getbytes((long)(atom_getfloat(argv+0)) * sizeof(long));
-            x->output_limit = (long)atom_getfloat(argv+0);
-            post("Number of states allocated for input: %ld.", (long)atom_getfloat(argv+0));
+            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+            pd_free((t_pd *)x);
+            return NULL;
         }
-        else
+        int argc_all = argc;
+        t_symbol *name = NULL;
+        argc = parseCreationFlags(x, argc, argv, positional, &name);
+        argv = positional;
+        if (x->frame_dim > 0 && (x->intern || x->dense_alphabet_size > 0))
         {
-            x->states = getbytes(x->default_size * sizeof(t_state));
-            x->input_limit = x->default_size;
-            x->output_string = getbytes(x->default_size * sizeof(long));
-            x->output_limit = x->default_size;
-            post("Argument 1 must be an integer greater than 0 specifying the number of input states. Allocating default: %ld.", x->default_size);
+            pd_error((t_object *)x, "-audio does not combine with -intern or -alphabet, which are ignored.");
+            x->intern = 0;
+            x->dense_alphabet_size = 0;
         }
-        
-        if (argc > 1)
+        x->oracle = (name != NULL) ? shareOracle(x, name) : oracle_new(x->dense_alphabet_size);
+        int interned = 1;
+        if (x->oracle != NULL && x->intern && x->oracle->interner == NULL)
+        {
+            if (x->shared != NULL && (x->shared->users != x || x->oracle->input_index > 0))
+            {
+                pd_error((t_object *)x, "-intern is ignored: the oracle '%s' is already in use without it.", name->s_name);
+            }
+            else
+            {
+                x->oracle->interner = interner_new();
+                interned = (x->oracle->interner != NULL);
+            }
+        }
+        if (x->oracle != NULL && x->frame_dim > 0 && x->oracle->frame_dim != x->frame_dim)
+        {
+            if (x->oracle->input_index > 0 || x->oracle->interner != NULL || x->oracle->dense_alphabet_size > 0
+                || (x->shared != NULL && x->shared->users != x))
+            {
+                pd_error((t_object *)x, "-audio is ignored: the oracle '%s' is already in use without it.", name->s_name);
+            }
+            else
+            {
+                x->oracle->frame_dim = x->frame_dim;
+                x->oracle->frame_stride = (x->frame_dim + FRAME_LANES - 1) / FRAME_LANES * FRAME_LANES;
+                x->oracle->frame_threshold = x->frame_threshold * x->frame_threshold;
+            }
+        }
+        if (c == factorOracle_tilde_class)
+        {
+            x->dsp = signalio_new(x);
+        }
+        if (x->oracle == NULL || !interned || setVoices(x, 1) != 0 || (c == factorOracle_tilde_class && x->dsp == NULL))
+        {
+            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+            freebytes(positional, (argc_all + 1) * sizeof(t_atom));
+            pd_free((t_pd *)x);
+            return NULL;
+        }
+        
+        long reserve = x->default_size;
+        if (argc >= 1 && ((argv)->a_type == A_FLOAT) && (atom_getfloat(argv) > -1))
+        {
+            reserve = (long)atom_getfloat(argv+0);
+            post("Number of states allocated for input: %ld.", reserve);
+        }
+        else
+        {
+            post("Argument 1 must be an integer greater than 0 specifying the number of input states. Allocating default: %ld.", x->default_size);
+        }
+        if (reserveStates(x->oracle, reserve + 1) != 0)
+        {
+            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        }
+        
+        if (argc > 1)
         {
             if ((argv+1)->a_type == A_SYMBOL)
             {
@@ -332,664 +1123,3757 @@ void *factorOracle_new(t_symbol *s, int argc, t_atom *argv)
         {
             post("Ignoring extra arguments.");
         }
+        freebytes(positional, (argc_all + 1) * sizeof(t_atom));
     }
     
-    srand((unsigned)time(NULL));
     return (void *)x;
 }
 
 
 
 
+// Both classes are set up here, so [factorOracle~] is available once the library is loaded, for example
+// with [declare -lib factorOracle].
 void factorOracle_setup(void) {
     factorOracle_class =
     (t_class *)class_new(gensym("factorOracle"),
                          (t_newmethod)factorOracle_new,
-                         0,
+                         (t_method)factorOracle_free,
                          sizeof(t_factorOracle),
                          CLASS_DEFAULT,
                          A_GIMME,
                          0);
-    class_addbang(factorOracle_class, factorOracle_bang);
-    class_addmethod(factorOracle_class, (t_method)factorOracle_mode, gensym("mode"), A_FLOAT, 0);
     class_addmethod(factorOracle_class, (t_method)factorOracle_float, gensym("float"), A_FLOAT, 0);
-    class_addmethod(factorOracle_class, (t_method)factorOracle_clear, gensym("clear"), 0);
-    class_addmethod(factorOracle_class, (t_method)factorOracle_probability, gensym("probability"), A_FLOAT, 0);
-    class_addanything(factorOracle_class, (t_method)factorOracle_anything);
+    addMethods(factorOracle_class);
+    
+    factorOracle_tilde_class =
+    (t_class *)class_new(gensym("factorOracle~"),
+                         (t_newmethod)factorOracle_tilde_new,
+                         (t_method)factorOracle_free,
+                         sizeof(t_factorOracle),
+                         CLASS_DEFAULT,
+                         A_GIMME,
+                         0);
+    CLASS_MAINSIGNALIN(factorOracle_tilde_class, t_factorOracle, signal_f);
+    class_addmethod(factorOracle_tilde_class, (t_method)factorOracle_tilde_dsp, gensym("dsp"), A_CANT, 0);
+    addMethods(factorOracle_tilde_class);
+    
     proxy_setup();
+    sharedoracle_class = class_new(gensym("factorOracle shared"), 0, 0, sizeof(t_sharedoracle), CLASS_PD, 0);
     fopenpanel_setup();
 }
 
 
 
 
+// The messages shared by both classes. Float input is left out: on [factorOracle~] the left inlet takes
+// the input as a signal.
+static void addMethods(t_class *c)
+{
+    class_addbang(c, factorOracle_bang);
+    class_addmethod(c, (t_method)factorOracle_mode, gensym("mode"), A_FLOAT, 0);
+    class_addlist(c, factorOracle_list);
+    class_addsymbol(c, factorOracle_symbol);
+    class_addmethod(c, (t_method)factorOracle_add, gensym("add"), A_SYMBOL, 0);
+    class_addmethod(c, (t_method)factorOracle_generate, gensym("generate"), A_FLOAT, A_DEFFLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_clear, gensym("clear"), 0);
+    class_addmethod(c, (t_method)factorOracle_probability, gensym("probability"), A_FLOAT, A_DEFFLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_seed, gensym("seed"), A_FLOAT, A_DEFFLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_forward, gensym("forward"), A_FLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_context, gensym("context"), A_FLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_threshold, gensym("threshold"), A_FLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_contexts, gensym("contexts"), A_GIMME, 0);
+    class_addmethod(c, (t_method)factorOracle_find, gensym("find"), A_GIMME, 0);
+    class_addmethod(c, (t_method)factorOracle_alphabet, gensym("alphabet"), 0);
+    class_addmethod(c, (t_method)factorOracle_histogram, gensym("histogram"), A_GIMME, 0);
+    class_addmethod(c, (t_method)factorOracle_save, gensym("save"), A_SYMBOL, 0);
+    class_addmethod(c, (t_method)factorOracle_load, gensym("load"), A_SYMBOL, 0);
+    class_addmethod(c, (t_method)factorOracle_json, gensym("json"), A_SYMBOL, 0);
+    class_addmethod(c, (t_method)factorOracle_truncate, gensym("truncate"), A_FLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_window, gensym("window"), A_FLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_jumpback, gensym("jumpback"), A_GIMME, 0);
+    class_addmethod(c, (t_method)factorOracle_voices, gensym("voices"), A_FLOAT, 0);
+    class_addmethod(c, (t_method)factorOracle_step, gensym("step"), A_GIMME, 0);
+    class_addmethod(c, (t_method)factorOracle_state, gensym("state"), A_GIMME, 0);
+    class_addanything(c, (t_method)factorOracle_anything);
+}
+
+
+
+
 void factorOracle_free(t_factorOracle *x)
 {
-    freebytes(x->alphabet, x->alphabet_size * sizeof(long));
-    freebytes(x->input_string, x->input_index * sizeof(long));
-    freebytes(x->output_string, x->input_index * sizeof(long));
+    signalio_free(x->dsp);
+    cancelLoad(x);
+    clock_free(x->load_clock);
+    freebytes(x->contexts, x->contexts_size * sizeof(t_atom));
+    freebytes(x->state_atoms, x->state_atoms_size * sizeof(t_atom));
+    freebytes(x->frame_atoms, x->frame_atoms_size * sizeof(t_atom));
+    freebytes(x->generated, x->generated_size * sizeof(t_atom));
+    unshareOracle(x);
+    freebytes(x->voices, x->voice_count * sizeof(t_voice));
+    fopenpanel_free(&x->fopenpanel);
+}
+
+
 
-    for (long i = 0; i < x->input_index; i ++)
+
+// A state's transitions share one arena block: end states, then their symbols, so that lookups never
+// touch the target states. Once the block holds TRANSITION_INDEX_MIN or more edges it also carries an
+// index mapping symbol -> edge number + 1 (0 marks an empty slot). The index is an open-addressing table
+// of 2 * capacity slots, or, with -alphabet, a table with one slot per symbol; -audio blocks have none.
+// Only the few states near the root reach that out-degree, so the rest of the oracle keeps the compact
+// layout either way.
+long transitionCapacity(long n)
+{
+    long capacity = 1;
+    while (capacity < n)
     {
-        freebytes(x->states[i].transitionEndStates, x->states[i].numberOfTransitionElements * sizeof(long));
+        capacity <<= 1;
     }
-    freebytes(x->states, x->input_limit + 1);
+    return capacity;
 }
 
 
 
 
-long memberOfTransitionElements(long transition, long k, t_factorOracle *x)
+// Audio oracles find edges by frame distance, never by symbol, so their blocks carry no index.
+static int hasTransitionIndex(t_oracle *o, long capacity)
 {
-    long test = -1;
-    long i;
-    for (i = 0; i < x->states[k].numberOfTransitionElements; i++)
-    {
-        if (transition == x->states[(x->states[k].transitionEndStates[i]) - 1].transitionElement)
-        {
-            test = i;
-            break;
-        }
-    }
-    return test;
+    return o->frame_dim == 0 && capacity >= TRANSITION_INDEX_MIN;
 }
 
 
 
 
-long buildOracle(long transition, t_factorOracle *x)
+static size_t transitionBlockBytes(t_oracle *o, long capacity)
 {
-    x->states[x->input_index].transitionElement = transition;
-    x->states[x->input_index].transitionEndStates = getbytes(sizeof(long));
-    if (x->states[x->input_index].transitionEndStates == NULL)
-    {
-        post("%s", MEMORY_ALLOCATION_ERROR);
-        return -1;
-    }
-    
-    x->states[x->input_index].transitionEndStates[0] = (x->input_index + 1);
-    x->states[x->input_index].numberOfTransitionElements = 1;
-    
-    long k;
-    if (x->input_index == 0)
-    {
-        x->states[x->input_index].suffixLink = -1;
-        k = -1;
-    }
-    else
-    {
-        k = x->states[x->input_index].suffixLink;
-    }
-    
-    while ((k != -1) && ((memberOfTransitionElements(transition, k, x)) == -1))
+    if (!hasTransitionIndex(o, capacity))
     {
-        x->states[k].transitionEndStates = resizebytes(x->states[k].transitionEndStates, x->states[k].numberOfTransitionElements * sizeof(long), (x->states[k].numberOfTransitionElements + 1) * sizeof(long));
-        if (x->states[k].transitionEndStates == NULL)
-        {
-            post("%s", MEMORY_ALLOCATION_ERROR);
-            return -1;
-        }
-        
-        x->states[k].transitionEndStates[x->states[k].numberOfTransitionElements] = (x->input_index + 1);
-        x->states[k].numberOfTransitionElements += 1;
-        k = x->states[k].suffixLink;
+        return 2 * capacity * sizeof(t_foindex);
     }
-    
-    if (k == -1)
+    else if (o->dense_alphabet_size > 0)
     {
-        x->states[x->input_index+1].suffixLink = 0;
+        return (2 * capacity + o->dense_alphabet_size) * sizeof(t_foindex);
     }
     else
     {
-        x->states[(x->input_index + 1)].suffixLink = x->states[k].transitionEndStates[memberOfTransitionElements(transition, k, x)];
+        return 4 * capacity * sizeof(t_foindex);
     }
-    x->states[(x->input_index + 1)].numberOfTransitionElements = 0;
-    
-    return 0;
 }
 
 
 
 
-void setState(t_factorOracle *x, long state_index)
+t_foindex *transitionEndStates(t_oracle *o, long k)
+{
+    return arena_pointer(&o->arena, STATE(o, edgeOffset, k));
+}
+
+
+
+
+t_foindex *transitionSymbols(t_oracle *o, long k)
+{
+    return transitionEndStates(o, k) + transitionCapacity(STATE(o, edgeCount, k));
+}
+
+
+
+
+static unsigned long transitionHash(long transition, long mask)
+{
+    return (unsigned long)(((uint64_t)transition * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & mask;
+}
+
+
+
+
+static void indexTransition(t_oracle *o, t_foindex *index, long mask, long transition, long i)
 {
-    if (x->input_index < 1)
+    if (o->dense_alphabet_size > 0)
     {
-        post(EMPTY_ORACLE_ERROR);
+        index[transition] = (t_foindex)(i + 1);
         return;
     }
     
-    if (state_index < 0 || state_index > x->input_index)
+    unsigned long h = transitionHash(transition, mask);
+    while (index[h] != 0)
     {
-        post("State index %ld is outside of index range [0, %ld].", state_index, x->input_index);
-        return;
+        h = (h + 1) & mask;
     }
-    x->output_state = state_index;
-    
-    outlet_float( x->m_outlet2, x->output_state);
+    index[h] = (t_foindex)(i + 1);
 }
 
 
 
 
-void getState(t_factorOracle *x)
+// Removes edge i from the index, moving later entries of its probe run back so no lookup hits a gap.
+static void unindexTransition(t_oracle *o, t_foindex *index, const t_foindex *symbols, long mask, long transition, long i)
 {
-    if (x->output_state < 0)
+    if (o->dense_alphabet_size > 0)
     {
-        post("Initial output state has not been selected.");
+        index[transition] = 0;
         return;
     }
     
-    t_atom *es;
-    t_atom *et;
-    long len;
-    
-    if (x->output_state == x->input_index)
+    unsigned long hole = transitionHash(transition, mask);
+    while (index[hole] != i + 1)
     {
-        es = getbytes(sizeof(t_atom));
-        et = getbytes(sizeof(t_atom));
-        if (es == NULL || et == NULL)
-        {
-            post("%s", MEMORY_ALLOCATION_ERROR);
-            return;
-        }
-        len = 1;
-        SETFLOAT(es, -1);
-        SETFLOAT(et, -1);
+        hole = (hole + 1) & mask;
     }
-    else
+    unsigned long j = hole;
+    while (1)
     {
-        len = x->states[x->output_state].numberOfTransitionElements;
-        es = getbytes(len * sizeof(t_atom));
-        et = getbytes(len * sizeof(t_atom));
-        if (es == NULL || et == NULL)
+        j = (j + 1) & mask;
+        if (index[j] == 0)
         {
-            post("%s", MEMORY_ALLOCATION_ERROR);
-            return;
+            break;
         }
-        long endState;
-        for (long i = 0; i < x->states[x->output_state].numberOfTransitionElements; i++)
+        unsigned long home = transitionHash(symbols[index[j] - 1], mask);
+        if (((j - home) & mask) >= ((j - hole) & mask))
         {
-            endState = x->states[x->output_state].transitionEndStates[i];
-            SETFLOAT(es+i, endState);
-            SETFLOAT(et+i, x->states[endState - 1].transitionElement);
+            index[hole] = index[j];
+            hole = j;
         }
     }
-
-    t_float input_index = x->input_index;
-    outlet_float( x->m_outlet1, input_index);
-    outlet_float( x->m_outlet2, x->output_state);
-    outlet_float( x->m_outlet3, x->states[x->output_state].numberOfTransitionElements);
-    outlet_list(x->m_outlet4, NULL, (int)len, et);
-    outlet_list(x->m_outlet5, NULL, (int)len, es);
-    outlet_float( x->m_outlet6, x->states[x->output_state].suffixLink);
-    
-    freebytes(es, sizeof(t_atom));
-    freebytes(et, sizeof(t_atom));
+    index[hole] = 0;
 }
 
 
 
 
-void chooseTransition(t_factorOracle *x)
+// Squared Euclidean distance between two frames. Frames are FRAME_ALIGN-aligned and padded with zeros to
+// frame_stride, a multiple of FRAME_LANES, so the vector loops need no tail.
+static float frameDistance(const float *a, const float *b, long stride)
 {
-    if (x->input_index < 1)
+#if defined(__AVX__)
+    __m256 sum = _mm256_setzero_ps();
+    for (long i = 0; i < stride; i += 8)
     {
-        post(EMPTY_ORACLE_ERROR);
-        return;
+        __m256 d = _mm256_sub_ps(_mm256_load_ps(a + i), _mm256_load_ps(b + i));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(d, d));
     }
-    
-    long output = 0;
-    if (x->output_index < x->output_limit)
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128 sum = _mm_setzero_ps();
+    for (long i = 0; i < stride; i += 4)
     {
-        switch (x->mode)
-        {
-            case 0:
-                output = mode_0(x);
-                break;
-            case 1:
-                output = mode_1(x);
-                break;
-            case 2:
-                output = mode_2(x);
-                break;
-        }
-        
-        x->output_string[x->output_index] = output;
-        x->output_index += 1;
+        __m128 d = _mm_sub_ps(_mm_load_ps(a + i), _mm_load_ps(b + i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
     }
-    else
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+#elif defined(__ARM_NEON)
+    float32x4_t sum = vdupq_n_f32(0);
+    for (long i = 0; i < stride; i += 4)
     {
-        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
-        return;
+        float32x4_t d = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        sum = vmlaq_f32(sum, d, d);
+    }
+    float32x2_t s = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+#else
+    float sum = 0;
+    for (long i = 0; i < stride; i++)
+    {
+        float d = a[i] - b[i];
+        sum += d * d;
     }
-    t_float out = output;
-    outlet_float(x->m_outlet10, out);
+    return sum;
+#endif
 }
 
 
 
 
-void addTransition(t_factorOracle *x, long transition)
+// With -audio, the symbol of input i is i itself and its feature frame is frames[i * frame_stride]. A
+// transition matches when the frame it leads to lies within the threshold of the new one; of those, the
+// nearest is taken.
+static long nearestFrame(t_oracle *o, long k, long transition)
 {
-    if (x->input_index < x->input_limit)
+    long n = STATE(o, edgeCount, k);
+    t_foindex *symbols = transitionSymbols(o, k);
+    const float *frame = o->frames + transition * o->frame_stride;
+    long nearest = -1;
+    float best = o->frame_threshold;
+    for (long i = 0; i < n; i++)
     {
-        if (buildOracle(transition, x) != 0)
+        float d = frameDistance(o->frames + symbols[i] * o->frame_stride, frame, o->frame_stride);
+        if (d <= best)
         {
-            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
-            return;
+            best = d;
+            nearest = i;
         }
-        x->input_index += 1;
-    }
-    else
-    {
-        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
     }
+    return nearest;
 }
 
 
 
 
-void factorOracle_bang(t_factorOracle *x)
+// The block size counts FRAME_ALIGN even when no frame was ever reserved, so only a real block is freed.
+static void freeFrames(t_oracle *o)
 {
-    chooseTransition(x);
+    if (o->frame_block != NULL)
+    {
+        freebytes(o->frame_block, o->frame_limit * o->frame_stride * sizeof(float) + FRAME_ALIGN);
+    }
 }
 
 
 
 
-void factorOracle_float(t_factorOracle *x, float transition)
+// Makes room for count frames. The block is over-allocated by FRAME_ALIGN so that the frames can start
+// on an aligned address, and new space comes zeroed, which keeps the padding lanes at 0.
+int reserveFrames(t_oracle *o, long count)
 {
-    addTransition(x, (long)transition);
+    if (count <= o->frame_limit)
+    {
+        return 0;
+    }
+    long limit = (o->frame_limit < 256) ? 256 : 2 * o->frame_limit;
+    while (limit < count)
+    {
+        limit *= 2;
+    }
+    size_t bytes = limit * o->frame_stride * sizeof(float);
+    char *block = getbytes(bytes + FRAME_ALIGN);
+    if (block == NULL)
+    {
+        return -1;
+    }
+    float *frames = (float *)(((uintptr_t)block + FRAME_ALIGN - 1) & ~(uintptr_t)(FRAME_ALIGN - 1));
+    if (o->frames != NULL)
+    {
+        memcpy(frames, o->frames, o->frame_limit * o->frame_stride * sizeof(float));
+    }
+    freeFrames(o);
+    o->frame_block = block;
+    o->frames = frames;
+    o->frame_limit = limit;
+    return 0;
 }
 
 
 
 
-void factorOracle_mode(t_factorOracle *x, float mode)
+long memberOfTransitionElements(long transition, long k, t_oracle *o)
 {
-    long m = (long)mode;
-    if (m < 0)
+    long n = STATE(o, edgeCount, k);
+    if (n == 0)
     {
-        x->mode = 0;
+        return -1;
     }
-    else if (m > 1)
+    if (o->frame_dim > 0)
     {
-        x->mode = 1;
+        return nearestFrame(o, k, transition);
     }
-    else
+    
+    long capacity = transitionCapacity(n);
+    t_foindex *symbols = transitionEndStates(o, k) + capacity;
+    if (capacity < TRANSITION_INDEX_MIN)
     {
-        x->mode = m;
+        for (long i = 0; i < n; i++)
+        {
+            if (symbols[i] == transition)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+    
+    t_foindex *index = symbols + capacity;
+    if (o->dense_alphabet_size > 0)
+    {
+        return index[transition] - 1;
+    }
+    
+    long mask = 2 * capacity - 1;
+    unsigned long h = transitionHash(transition, mask);
+    while (index[h] != 0)
+    {
+        if (symbols[index[h] - 1] == transition)
+        {
+            return index[h] - 1;
+        }
+        h = (h + 1) & mask;
     }
+    return -1;
 }
 
 
 
 
-int getInputString(t_factorOracle *x)
+long appendTransition(t_oracle *o, long k, long end_state, long transition)
 {
-    freebytes(x->input_string, sizeof(long) * x->input_index);
+    long n = STATE(o, edgeCount, k);
+    long capacity = transitionCapacity(n);
     
-    x->input_string = getbytes(x->input_index * sizeof(long));
-    if (x->input_string == NULL) {
-        post("%s", MEMORY_ALLOCATION_ERROR);
-        return -1;
+    if (n == 0 || n == capacity)
+    {
+        long grown_capacity = (n == 0) ? 1 : 2 * capacity;
+        t_arenahandle handle = arena_alloc(&o->arena, transitionBlockBytes(o, grown_capacity));
+        if (handle == ARENA_NULL)
+        {
+            return -1;
+        }
+        t_foindex *grown = arena_pointer(&o->arena, handle);
+        if (n > 0)
+        {
+            t_foindex *block = transitionEndStates(o, k);
+            memcpy(grown, block, n * sizeof(t_foindex));
+            memcpy(grown + grown_capacity, block + capacity, n * sizeof(t_foindex));
+            arena_release(&o->arena, STATE(o, edgeOffset, k), transitionBlockBytes(o, capacity));
+        }
+        if (hasTransitionIndex(o, grown_capacity))
+        {
+            t_foindex *index = grown + 2 * grown_capacity;
+            memset(index, 0, transitionBlockBytes(o, grown_capacity) - 2 * grown_capacity * sizeof(t_foindex));
+            for (long i = 0; i < n; i++)
+            {
+                indexTransition(o, index, 2 * grown_capacity - 1, grown[grown_capacity + i], i);
+            }
+        }
+        capacity = grown_capacity;
+        STATE(o, edgeOffset, k) = handle;
     }
     
-    for (long i = 0; i < x->input_index; i++) {
-        x->input_string[i] = x->states[i].transitionElement;
+    t_foindex *block = transitionEndStates(o, k);
+    block[n] = (t_foindex)end_state;
+    block[capacity + n] = (t_foindex)transition;
+    if (hasTransitionIndex(o, capacity))
+    {
+        indexTransition(o, block + 2 * capacity, 2 * capacity - 1, transition, n);
     }
-    
+    STATE(o, edgeCount, k) = (t_foindex)(n + 1);
     return 0;
 }
 
 
 
 
-void factorOracle_clear(t_factorOracle *x)
+// Undoes the last appendTransition() on state k. When the capacity halves, the block is compacted in place
+// and its tail goes back to the arena, so this never allocates.
+void removeLastTransition(t_oracle *o, long k)
+{
+    long n = STATE(o, edgeCount, k);
+    long capacity = transitionCapacity(n);
+    t_foindex *block = transitionEndStates(o, k);
+    STATE(o, edgeCount, k) = (t_foindex)(n - 1);
+    
+    if (n == 1)
+    {
+        arena_release(&o->arena, STATE(o, edgeOffset, k), transitionBlockBytes(o, 1));
+        return;
+    }
+    if (transitionCapacity(n - 1) == capacity)
+    {
+        if (hasTransitionIndex(o, capacity))
+        {
+            unindexTransition(o, block + 2 * capacity, block + capacity, 2 * capacity - 1, block[capacity + n - 1], n - 1);
+        }
+        return;
+    }
+    
+    long shrunk_capacity = capacity / 2;
+    memmove(block + shrunk_capacity, block + capacity, (n - 1) * sizeof(t_foindex));
+    if (hasTransitionIndex(o, shrunk_capacity))
+    {
+        t_foindex *index = block + 2 * shrunk_capacity;
+        memset(index, 0, transitionBlockBytes(o, shrunk_capacity) - 2 * shrunk_capacity * sizeof(t_foindex));
+        for (long i = 0; i < n - 1; i++)
+        {
+            indexTransition(o, index, 2 * shrunk_capacity - 1, block[shrunk_capacity + i], i);
+        }
+    }
+    arena_shrink(&o->arena, STATE(o, edgeOffset, k), transitionBlockBytes(o, capacity), transitionBlockBytes(o, shrunk_capacity));
+}
+
+
+
+
+// Length of the suffix shared by the prefixes ending at states p1 and p2, where p2 is on the suffix-link
+// path below p1's link (Lefebvre & Lecroq, "Computing repeated factors with a factor oracle").
+long lengthCommonSuffix(t_oracle *o, long p1, long p2)
 {
-    freebytes(x->alphabet, x->alphabet_size * sizeof(long));
-    freebytes(x->input_string, x->input_index * sizeof(long));
-    for (long i = 0; i < x->input_index; i ++)
+    if (p2 == STATE(o, suffixLink, p1))
+    {
+        return STATE(o, lrs, p1);
+    }
+    while (p2 != 0 && STATE(o, suffixLink, p2) != STATE(o, suffixLink, p1))
     {
-        freebytes(x->states[i].transitionEndStates, x->states[i].numberOfTransitionElements * sizeof(long));
-        x->states[i].numberOfTransitionElements = 0;
+        p2 = STATE(o, suffixLink, p2);
     }
-    x->input_index = 0;
-    x->output_index = 0;
-    x->output_state = -1;
+    long a = STATE(o, lrs, p1);
+    long b = STATE(o, lrs, p2);
+    return (a < b) ? a : b;
 }
 
 
 
 
-int compare(const void *a, const void *b)
+// Inserts state into the children of its suffix link in the reverse suffix-link tree. Children are kept
+// in order of decreasing lrs so that contexts() can stop at the first child that shares too little.
+// New states mostly have the smallest lrs among their siblings, so the insertion is usually at the front
+// or after a few siblings.
+static void linkChild(t_oracle *o, long state)
 {
-    long x = *(const long *)a;
-    long y = *(const long *)b;
+    long parent = STATE(o, suffixLink, state);
+    long length = STATE(o, lrs, state);
+    STATE(o, firstChild, state) = -1;
     
-    if (x < y)
+    long previous = -1;
+    long child = STATE(o, firstChild, parent);
+    while (child != -1 && STATE(o, lrs, child) > length)
     {
-        return -1;
+        previous = child;
+        child = STATE(o, nextSibling, child);
     }
-    else if (x > y)
+    STATE(o, nextSibling, state) = (t_foindex)child;
+    if (previous == -1)
     {
-        return 1;
+        STATE(o, firstChild, parent) = (t_foindex)state;
     }
     else
     {
-        return 0;
+        STATE(o, nextSibling, previous) = (t_foindex)state;
     }
 }
 
 
 
 
-long getAlphabet(t_factorOracle *x)
+static void unlinkChild(t_oracle *o, long state)
 {
-    freebytes(x->alphabet, x->alphabet_size * sizeof(long));
-    x->alphabet_size = 0;
-    
-    getInputString(x);
-    
-    long *tmp = getbytes(x->input_index * sizeof(long)); //get rid of clear
-    if (tmp == NULL) {
-        post("%s", MEMORY_ALLOCATION_ERROR);
-        return -1;
-    }
-    
-    long i;
-    for (i = 0; i < x->input_index; i++) {
-        tmp[i] = x->input_string[i];
-    }
-    
-    qsort(tmp, x->input_index, sizeof(long), compare);
-    
-    x->alphabet = getbytes(sizeof(long));
-    if (x->alphabet == NULL)
+    long parent = STATE(o, suffixLink, state);
+    if (STATE(o, firstChild, parent) == state)
     {
-        post(MEMORY_ALLOCATION_ERROR);
-        return -1;
+        STATE(o, firstChild, parent) = STATE(o, nextSibling, state);
+        return;
     }
-    unsigned long alphabet_index = 0;
-    for (i = 0; i < x->input_index - 1; i++)
+    long child = STATE(o, firstChild, parent);
+    while (STATE(o, nextSibling, child) != state)
     {
-        if (tmp[i] != tmp[i + 1]) {
-            x->alphabet[alphabet_index] = tmp[i];
-            alphabet_index = alphabet_index + 1;
-            x->alphabet = resizebytes(x->alphabet, alphabet_index * sizeof(long), (alphabet_index + 1) * sizeof(long));
-            if (x->alphabet == NULL)
-            {
-                post(MEMORY_ALLOCATION_ERROR);
-                return -1;
-            }
-        }
+        child = STATE(o, nextSibling, child);
     }
-    x->alphabet[alphabet_index] = tmp[x->input_index - 1];
-    x->alphabet_size = alphabet_index + 1;
-    
-    freebytes(tmp, sizeof(long) * x->input_index);
-    freebytes(x->input_string, sizeof(long) * x->input_index); // Conserve memory.
-    
-    return x->alphabet_size;
+    STATE(o, nextSibling, child) = STATE(o, nextSibling, state);
 }
 
 
 
 
-long json(t_factorOracle *x)
+// The alphabet is kept with the oracle: the distinct symbols in order of first appearance, how often each
+// occurs, and an open-addressing index of 2 * alphabet_limit slots mapping a symbol to its position + 1.
+static long alphabetSlot(t_oracle *o, long transition)
 {
-    unsigned long MAX_LONG_CHARS;
-    if (sizeof(long) == 4)
+    long mask = 2 * o->alphabet_limit - 1;
+    long slot = transitionHash(transition, mask);
+    while (o->alphabet_index[slot] != 0 && o->alphabet[o->alphabet_index[slot] - 1] != transition)
     {
-        MAX_LONG_CHARS = 12;
+        slot = (slot + 1) & mask;
     }
-    else
+    return slot;
+}
+
+
+
+
+static int growAlphabet(t_oracle *o)
+{
+    long limit = (o->alphabet_limit == 0) ? 16 : 2 * o->alphabet_limit;
+    t_foindex *alphabet = resizebytes(o->alphabet, o->alphabet_limit * sizeof(t_foindex), limit * sizeof(t_foindex));
+    if (alphabet == NULL)
     {
-        MAX_LONG_CHARS = 21;
+        return -1;
     }
-
-    x->json = getbytes(4 * x->input_index * MAX_LONG_CHARS * CHAR_BIT + 24 * x->input_index * CHAR_BIT - 2 * MAX_LONG_CHARS * CHAR_BIT - 2 * CHAR_BIT);
-    if (x->json == NULL)
+    o->alphabet = alphabet;
+    long *counts = resizebytes(o->alphabet_counts, o->alphabet_limit * sizeof(long), limit * sizeof(long));
+    if (counts == NULL)
     {
-        post(MEMORY_ALLOCATION_ERROR);
         return -1;
     }
-    
-    unsigned long tmpbuff_size = (CHAR_BIT * (MAX_LONG_CHARS * 2 + 6)), tcb = (CHAR_BIT * 2);
-    char *tmpbuff = getbytes(tmpbuff_size);
-    if (x->json == NULL)
+    o->alphabet_counts = counts;
+    t_foindex *index = getbytes(2 * limit * sizeof(t_foindex));
+    if (index == NULL)
     {
-        post(MEMORY_ALLOCATION_ERROR);
         return -1;
     }
-    
-    unsigned long len, i, j, json_next_index = 0;
-    long end_state, transition;
-    
-    len = snprintf(tmpbuff, tcb, "{\n");
-    memcpy(x->json+json_next_index, tmpbuff, len);
-    json_next_index += len;
-    for (i = 0; i <= x->input_index; i++)
+    freebytes(o->alphabet_index, 2 * o->alphabet_limit * sizeof(t_foindex));
+    o->alphabet_index = index;
+    o->alphabet_limit = limit;
+    for (long i = 0; i < o->alphabet_size; i++)
     {
-        if (i > 0)
-        {
-            len = snprintf(tmpbuff, tcb, ",\n");
-            memcpy(x->json+json_next_index, tmpbuff, len);
-            json_next_index += len;
-        }
-        len = snprintf(tmpbuff, tmpbuff_size, "\"%ld\":[{", i);
-        memcpy(x->json+json_next_index, tmpbuff, len);
-        json_next_index += len;
-        for (j = 0; j < x->states[i].numberOfTransitionElements; j++)
-        {
-            if (j > 0)
-            {
-                len = snprintf(tmpbuff, CHAR_BIT, ",");
-                memcpy(x->json+json_next_index, tmpbuff, len);
-                json_next_index += len;
-            }
-            end_state = x->states[i].transitionEndStates[j];
-            transition = x->states[end_state - 1].transitionElement;
-            len = snprintf(tmpbuff, tmpbuff_size, "\"%ld\":\"%ld\"", end_state, transition);
-            memcpy(x->json+json_next_index, tmpbuff, len);
-            json_next_index += len;
-        }
-        len = snprintf(tmpbuff, tmpbuff_size, "},\"%ld\"]", x->states[i].suffixLink);
-        memcpy(x->json+json_next_index, tmpbuff, len);
-        json_next_index += len;
+        o->alphabet_index[alphabetSlot(o, o->alphabet[i])] = (t_foindex)(i + 1);
     }
-    len = snprintf(tmpbuff, tcb, "\n}");
-    memcpy(x->json+json_next_index, tmpbuff, len);
-    json_next_index += len;
-    
-    freebytes(tmpbuff, tmpbuff_size);
-    return json_next_index;
+    return 0;
 }
 
 
 
 
-void factorOracle_dowrite(t_factorOracle *x, t_symbol *s)
+// Returns how often transition occurs in the input.
+long symbolCount(t_oracle *o, long transition)
 {
-    if (x->input_index < 1)
+    if (o->alphabet_size == 0)
     {
-        pd_error((t_object *)x, "%s", EMPTY_ORACLE_ERROR);
+        return 0;
     }
-    else
-    {
-        t_binbuf *b = binbuf_new();
-        long size = x->input_index * sizeof(t_atom);
+    long position = o->alphabet_index[alphabetSlot(o, transition)];
+    return (position == 0) ? 0 : o->alphabet_counts[position - 1];
+}
+
+
+
+
+int countSymbol(t_oracle *o, long transition)
+{
+    if (o->frame_dim > 0)
+    {
+        return 0;
+    }
+    if (o->alphabet_size == o->alphabet_limit && growAlphabet(o) != 0)
+    {
+        return -1;
+    }
+    long slot = alphabetSlot(o, transition);
+    if (o->alphabet_index[slot] == 0)
+    {
+        o->alphabet[o->alphabet_size] = (t_foindex)transition;
+        o->alphabet_counts[o->alphabet_size] = 0;
+        o->alphabet_index[slot] = (t_foindex)(++o->alphabet_size);
+    }
+    o->alphabet_counts[o->alphabet_index[slot] - 1]++;
+    return 0;
+}
+
+
+
+
+// Undoes countSymbol() for the last input. Inputs go in reverse order, so a symbol whose count drops to
+// zero was the last new one, and it leaves the index by backward-shift deletion.
+void uncountSymbol(t_oracle *o, long transition)
+{
+    if (o->frame_dim > 0)
+    {
+        return;
+    }
+    long mask = 2 * o->alphabet_limit - 1;
+    long slot = alphabetSlot(o, transition);
+    if (--o->alphabet_counts[o->alphabet_index[slot] - 1] > 0)
+    {
+        return;
+    }
+    o->alphabet_size--;
+    long next = (slot + 1) & mask;
+    while (o->alphabet_index[next] != 0)
+    {
+        long home = transitionHash(o->alphabet[o->alphabet_index[next] - 1], mask);
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            o->alphabet_index[slot] = o->alphabet_index[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    o->alphabet_index[slot] = 0;
+}
+
+
+
+
+void resetAlphabet(t_oracle *o)
+{
+    o->alphabet_size = 0;
+    if (o->alphabet_index != NULL)
+    {
+        memset(o->alphabet_index, 0, 2 * o->alphabet_limit * sizeof(t_foindex));
+    }
+}
+
+
+
+
+t_interner *interner_new(void)
+{
+    t_interner *t = getbytes(sizeof(t_interner));
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    t->atoms = NULL;
+    t->atom_count = 0;
+    t->atom_limit = 0;
+    t->offsets = NULL;
+    t->count = 0;
+    t->limit = 0;
+    t->index = NULL;
+    return t;
+}
+
+
+
+
+void interner_free(t_interner *t)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    freebytes(t->atoms, t->atom_limit * sizeof(t_atom));
+    freebytes(t->offsets, (t->limit + 1) * sizeof(long));
+    freebytes(t->index, 2 * t->limit * sizeof(t_foindex));
+    freebytes(t, sizeof(t_interner));
+}
+
+
+
+
+// Forgets every event but keeps the storage, so that ids start again at 0.
+void interner_reset(t_interner *t)
+{
+    t->atom_count = 0;
+    t->count = 0;
+    if (t->index != NULL)
+    {
+        memset(t->index, 0, 2 * t->limit * sizeof(t_foindex));
+    }
+}
+
+
+
+
+static uint64_t eventHash(const t_atom *event, long n)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)n;
+    for (long i = 0; i < n; i++)
+    {
+        uint64_t v;
+        if (event[i].a_type == A_SYMBOL)
+        {
+            v = (uint64_t)(uintptr_t)event[i].a_w.w_symbol;
+        }
+        else
+        {
+            double f = event[i].a_w.w_float + 0.0;  // -0 and 0 are the same event
+            memcpy(&v, &f, sizeof(v));
+        }
+        h = (h ^ v ^ ((uint64_t)event[i].a_type << 56)) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    return h;
+}
+
+
+
+
+static int sameEvent(const t_atom *a, long n, const t_atom *b, long m)
+{
+    if (n != m)
+    {
+        return 0;
+    }
+    for (long i = 0; i < n; i++)
+    {
+        if (a[i].a_type != b[i].a_type
+            || (a[i].a_type == A_SYMBOL ? a[i].a_w.w_symbol != b[i].a_w.w_symbol : a[i].a_w.w_float != b[i].a_w.w_float))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+
+// Returns the atoms of event id and stores their number in n.
+static const t_atom *internedEvent(const t_interner *t, long id, long *n)
+{
+    *n = t->offsets[id + 1] - t->offsets[id];
+    return t->atoms + t->offsets[id];
+}
+
+
+
+
+static long internSlot(const t_interner *t, const t_atom *event, long n, uint64_t h)
+{
+    long mask = 2 * t->limit - 1;
+    long slot = (long)(h & (uint64_t)mask);
+    while (t->index[slot] != 0)
+    {
+        long m;
+        const t_atom *stored = internedEvent(t, t->index[slot] - 1, &m);
+        if (sameEvent(stored, m, event, n))
+        {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+
+
+
+static int growInterner(t_interner *t)
+{
+    long limit = (t->limit == 0) ? 64 : 2 * t->limit;
+    long *offsets = resizebytes(t->offsets, (t->limit + 1) * sizeof(long), (limit + 1) * sizeof(long));
+    if (offsets == NULL)
+    {
+        return -1;
+    }
+    t->offsets = offsets;
+    t->offsets[t->count] = t->atom_count;
+    t_foindex *index = getbytes(2 * limit * sizeof(t_foindex));
+    if (index == NULL)
+    {
+        return -1;
+    }
+    freebytes(t->index, 2 * t->limit * sizeof(t_foindex));
+    t->index = index;
+    t->limit = limit;
+    for (long id = 0; id < t->count; id++)
+    {
+        long n;
+        const t_atom *event = internedEvent(t, id, &n);
+        t->index[internSlot(t, event, n, eventHash(event, n))] = (t_foindex)(id + 1);
+    }
+    return 0;
+}
+
+
+
+
+// Returns the id of event, a sequence of n floats and symbols, adding it if it is new. Returns -2 when
+// a new event would need an id of max_count or more (0 for no limit), and -1 when out of memory. Known
+// events only cost a hash lookup, and storage grows by doubling, so nothing is allocated once warm.
+long internEvent(t_interner *t, const t_atom *event, long n, long max_count)
+{
+    if (t->count == t->limit && growInterner(t) != 0)
+    {
+        return -1;
+    }
+    uint64_t h = eventHash(event, n);
+    long slot = internSlot(t, event, n, h);
+    if (t->index[slot] != 0)
+    {
+        return t->index[slot] - 1;
+    }
+    if (max_count > 0 && t->count >= max_count)
+    {
+        return -2;
+    }
+    if (t->atom_count + n > t->atom_limit)
+    {
+        long atom_limit = (t->atom_limit == 0) ? 256 : 2 * t->atom_limit;
+        while (atom_limit < t->atom_count + n)
+        {
+            atom_limit *= 2;
+        }
+        t_atom *atoms = resizebytes(t->atoms, t->atom_limit * sizeof(t_atom), atom_limit * sizeof(t_atom));
+        if (atoms == NULL)
+        {
+            return -1;
+        }
+        t->atoms = atoms;
+        t->atom_limit = atom_limit;
+    }
+    memcpy(t->atoms + t->atom_count, event, n * sizeof(t_atom));
+    t->atom_count += n;
+    t->offsets[t->count + 1] = t->atom_count;
+    t->index[slot] = (t_foindex)(++t->count);
+    return t->count - 1;
+}
+
+
+
+
+// Returns the id of event, or -1 if it has not been interned. Never adds it.
+long lookupEvent(const t_interner *t, const t_atom *event, long n)
+{
+    if (t->count == 0)
+    {
+        return -1;
+    }
+    long slot = internSlot(t, event, n, eventHash(event, n));
+    return t->index[slot] - 1;
+}
+
+
+
+
+// Restores the oracle to exactly what it was after length inputs. Steps are undone last first, so every
+// edge added by step n, which all lead to state n + 1, is by then the last edge of its state: the forward
+// edge of state n, then the run of states along the suffix links of n that gained one. That makes the
+// structure its own journal, and undoing a step costs what building it did.
+void truncateOracle(t_oracle *o, long length)
+{
+    for (long n = o->input_index - 1; n >= length; n--)
+    {
+        unlinkChild(o, n + 1);
+        uncountSymbol(o, STATE(o, symbol, n));
+        removeLastTransition(o, n);
+        long k = STATE(o, suffixLink, n);
+        while (k != -1 && STATE(o, edgeCount, k) > 0 && transitionEndStates(o, k)[STATE(o, edgeCount, k) - 1] == n + 1)
+        {
+            removeLastTransition(o, k);
+            k = STATE(o, suffixLink, k);
+        }
+    }
+    o->input_index = length;
+}
+
+
+
+
+// Adds transition as a new state, updating the suffix links, the far links used by jumpBack(), the
+// length of the repeated suffix (lrs) of the new state and the alphabet, all in amortised constant time.
+long buildOracle(long transition, t_oracle *o)
+{
+    if (reserveStates(o, o->input_index + 2) != 0)
+    {
+        return -1;
+    }
+    
+    STATE(o, symbol, o->input_index) = (t_foindex)transition;
+    STATE(o, edgeCount, o->input_index) = 0;
+    if (appendTransition(o, o->input_index, o->input_index + 1, transition) != 0)
+    {
+        return -1;
+    }
+    
+    long k;
+    if (o->input_index == 0)
+    {
+        STATE(o, suffixLink, o->input_index) = -1;
+        STATE(o, farLink, o->input_index) = 0;
+        STATE(o, lrs, o->input_index) = 0;
+        STATE(o, firstChild, o->input_index) = -1;
+        STATE(o, nextSibling, o->input_index) = -1;
+        k = -1;
+    }
+    else
+    {
+        k = STATE(o, suffixLink, o->input_index);
+    }
+    
+    long i = -1;
+    long last_visited = o->input_index;
+    while ((k != -1) && ((i = memberOfTransitionElements(transition, k, o)) == -1))
+    {
+        if (appendTransition(o, k, o->input_index + 1, transition) != 0)
+        {
+            return -1;
+        }
+        last_visited = k;
+        k = STATE(o, suffixLink, k);
+    }
+    
+    if (k == -1)
+    {
+        STATE(o, suffixLink, o->input_index + 1) = 0;
+        STATE(o, lrs, o->input_index + 1) = 0;
+    }
+    else
+    {
+        STATE(o, suffixLink, o->input_index + 1) = transitionEndStates(o, k)[i];
+        STATE(o, lrs, o->input_index + 1) = (t_foindex)(lengthCommonSuffix(o, last_visited, STATE(o, suffixLink, o->input_index + 1) - 1) + 1);
+    }
+    STATE(o, edgeCount, o->input_index + 1) = 0;
+    linkChild(o, o->input_index + 1);
+    
+    // Memoise jumpBack() for the new state: its first suffix link that skips more than one state.
+    long link = STATE(o, suffixLink, o->input_index + 1);
+    if (link == 0)
+    {
+        STATE(o, farLink, o->input_index + 1) = 0;
+    }
+    else if (o->input_index + 1 - link > 1)
+    {
+        STATE(o, farLink, o->input_index + 1) = (t_foindex)link;
+    }
+    else
+    {
+        STATE(o, farLink, o->input_index + 1) = STATE(o, farLink, link);
+    }
+    
+    return countSymbol(o, transition);
+}
+
+
+
+
+void setState(t_factorOracle *x, long voice, long state_index)
+{
+    if (x->oracle->input_index < 1)
+    {
+        post(EMPTY_ORACLE_ERROR);
+        return;
+    }
+    
+    if (state_index < 0 || state_index > x->oracle->input_index)
+    {
+        post("State index %ld is outside of index range [0, %ld].", state_index, x->oracle->input_index);
+        return;
+    }
+    t_voice *v = voiceAt(x, voice);
+    if (v == NULL)
+    {
+        return;
+    }
+    v->output_state = state_index;
+    
+    outlet_float( x->m_outlet2, v->output_state);
+}
+
+
+
+
+// Outputs the fields of the state of voice 0 selected by fields, a mask of STATE_* bits. The edge lists
+// are built in a scratch buffer kept by the object, so polling a state does not allocate. The buffer is
+// taken out of the object while the fields are output, as the receivers may query again.
+void getState(t_factorOracle *x, unsigned fields)
+{
+    long state = x->voices[0].output_state;
+    if (state < 0)
+    {
+        post("Initial output state has not been selected.");
+        return;
+    }
+    
+    long count = STATE(x->oracle, edgeCount, state);
+    long len = (state == x->oracle->input_index) ? 1 : count;
+    t_atom *atoms;
+    long size;
+    t_atom *et = NULL;
+    t_atom *es = NULL;
+    takeAtoms(&x->state_atoms, &x->state_atoms_size, &atoms, &size);
+    if (fields & (STATE_SYMBOLS | STATE_TARGETS))
+    {
+        if (reserveAtoms(&atoms, &size, 2 * len) != 0)
+        {
+            post("%s", MEMORY_ALLOCATION_ERROR);
+            returnAtoms(&x->state_atoms, &x->state_atoms_size, atoms, size);
+            return;
+        }
+        et = atoms;
+        es = atoms + len;
+        if (state == x->oracle->input_index)
+        {
+            SETFLOAT(es, -1);
+            SETFLOAT(et, -1);
+        }
+        else
+        {
+            t_foindex *end_states = transitionEndStates(x->oracle, state);
+            t_foindex *symbols = transitionSymbols(x->oracle, state);
+            for (long i = 0; i < count; i++)
+            {
+                SETFLOAT(es+i, end_states[i]);
+                SETFLOAT(et+i, symbols[i]);
+            }
+        }
+    }
+
+    if (fields & STATE_INPUTS)
+    {
+        outlet_float( x->m_outlet1, x->oracle->input_index);
+    }
+    if (fields & STATE_INDEX)
+    {
+        outlet_float( x->m_outlet2, state);
+    }
+    if (fields & STATE_COUNT)
+    {
+        outlet_float( x->m_outlet3, count);
+    }
+    if (fields & STATE_SYMBOLS)
+    {
+        outlet_list(x->m_outlet4, NULL, (int)len, et);
+    }
+    if (fields & STATE_TARGETS)
+    {
+        outlet_list(x->m_outlet5, NULL, (int)len, es);
+    }
+    if (fields & STATE_LINK)
+    {
+        outlet_float( x->m_outlet6, STATE(x->oracle, suffixLink, state));
+    }
+    returnAtoms(&x->state_atoms, &x->state_atoms_size, atoms, size);
+}
+
+
+
+
+// Takes one step of voice v with the current mode and returns its symbol.
+long nextTransition(t_factorOracle *x, t_voice *v)
+{
+    switch (x->mode)
+    {
+        case 0:
+            return mode_0(x, v);
+        case 1:
+            return mode_1(x, v);
+        case 2:
+            return mode_2(x, v);
+        default:
+            return 0;
+    }
+}
+
+
+
+
+void chooseTransition(t_factorOracle *x)
+{
+    if (x->oracle->input_index < 1)
+    {
+        post(EMPTY_ORACLE_ERROR);
+        return;
+    }
+    
+    outputEvent(x, nextTransition(x, x->voices));
+}
+
+
+
+
+// Grows a reusable atom buffer of size atoms, doubling it, until it holds at least count.
+static int reserveAtoms(t_atom **atoms, long *size, long count)
+{
+    if (count <= *size)
+    {
+        return 0;
+    }
+    long grown_size = (*size == 0) ? 64 : *size * 2;
+    while (grown_size < count)
+    {
+        grown_size *= 2;
+    }
+    t_atom *grown = (t_atom *)resizebytes(*atoms, *size * sizeof(t_atom), grown_size * sizeof(t_atom));
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    *atoms = grown;
+    *size = grown_size;
+    return 0;
+}
+
+
+
+
+// A reply is sent from a scratch buffer taken out of the object, so that a receiver that queries the
+// object again gets a buffer of its own instead of overwriting or moving the one still being sent.
+static void takeAtoms(t_atom **scratch, long *scratch_size, t_atom **atoms, long *size)
+{
+    *atoms = *scratch;
+    *size = *scratch_size;
+    *scratch = NULL;
+    *scratch_size = 0;
+}
+
+
+
+
+// Puts a taken buffer back, keeping the larger one if a nested query made another in the meantime.
+static void returnAtoms(t_atom **scratch, long *scratch_size, t_atom *atoms, long size)
+{
+    if (*scratch_size > size)
+    {
+        freebytes(atoms, size * sizeof(t_atom));
+        return;
+    }
+    freebytes(*scratch, *scratch_size * sizeof(t_atom));
+    *scratch = atoms;
+    *scratch_size = size;
+}
+
+
+
+
+// Takes a number of steps in one go and outputs them as a single list, or with -intern as one event after
+// another. If with_states is non-zero, the state reached by each step is output as a list on the state
+// outlet first. The symbols and the states share a buffer that the object keeps between calls.
+void factorOracle_generate(t_factorOracle *x, t_floatarg steps, t_floatarg with_states)
+{
+    if (x->oracle->input_index < 1)
+    {
+        post(EMPTY_ORACLE_ERROR);
+        return;
+    }
+    if (steps < 1)
+    {
+        pd_error((t_object *)x, "generate needs a number of steps greater than 0.");
+        return;
+    }
+    if (steps > GENERATE_MAX)
+    {
+        post("generate takes at most %d steps at a time.", GENERATE_MAX);
+        steps = GENERATE_MAX;
+    }
+    
+    int n = (int)steps;
+    t_atom *atoms;
+    long size;
+    takeAtoms(&x->generated, &x->generated_size, &atoms, &size);
+    if (reserveAtoms(&atoms, &size, (with_states != 0) ? 2 * n : n) != 0)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        returnAtoms(&x->generated, &x->generated_size, atoms, size);
+        return;
+    }
+    t_atom *symbols = atoms;
+    t_atom *states = (with_states != 0) ? atoms + n : NULL;
+    
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        SETFLOAT(symbols + i, nextTransition(x, x->voices));
+        if (states != NULL)
+        {
+            SETFLOAT(states + i, x->voices[0].output_state);
+        }
+    }
+    
+    if (states != NULL)
+    {
+        outlet_list(x->m_outlet2, &s_list, i, states);
+    }
+    outputEvents(x, symbols, i);
+    returnAtoms(&x->generated, &x->generated_size, atoms, size);
+}
+
+
+
+
+void addTransition(t_factorOracle *x, long transition)
+{
+    if (!canWrite(x) || windowFull(x))
+    {
+        return;
+    }
+    if (buildOracle(transition, x->oracle) != 0)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        return;
+    }
+    x->oracle->input_index += 1;
+    slideWindow(x);
+}
+
+
+
+
+void factorOracle_bang(t_factorOracle *x)
+{
+    chooseTransition(x);
+}
+
+
+
+
+static int transitionInRange(t_oracle *o, long transition)
+{
+    if (transition < FOINDEX_MIN || transition > FOINDEX_MAX)
+    {
+        return 0;
+    }
+    return o->dense_alphabet_size == 0 || (transition >= 0 && transition < o->dense_alphabet_size);
+}
+
+
+
+
+int validTransition(t_factorOracle *x, long transition)
+{
+    if (transition < FOINDEX_MIN || transition > FOINDEX_MAX)
+    {
+        pd_error((t_object *)x, "Input %ld does not fit in a %d-bit symbol.", transition, (int)(8 * sizeof(t_foindex)));
+        return 0;
+    }
+    if (!transitionInRange(x->oracle, transition))
+    {
+        pd_error((t_object *)x, "Input %ld is outside of the alphabet range [0, %ld).", transition, x->dense_alphabet_size);
+        return 0;
+    }
+    return 1;
+}
+
+
+
+
+// Adds count transitions taken from either atoms or words. State storage is reserved once for the
+// whole batch, and values that are not valid input are skipped and reported in a single error. In a
+// window, only the last window values of the batch are added, as the others would be evicted anyway,
+// and the window slides as they go in.
+long addTransitions(t_factorOracle *x, const t_atom *atoms, const t_word *words, long count)
+{
+    if (count < 1 || !canWrite(x))
+    {
+        return 0;
+    }
+    long start = (x->window > 0 && count > x->window) ? count - x->window : 0;
+    if (reserveStates(x->oracle, x->oracle->input_index + (count - start) + 1) != 0)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        return 0;
+    }
+    
+    long added = 0;
+    long skipped = 0;
+    for (long i = start; i < count; i++)
+    {
+        long transition;
+        if (atoms != NULL)
+        {
+            if (atoms[i].a_type != A_FLOAT)
+            {
+                skipped++;
+                continue;
+            }
+            transition = (long)atom_getfloat(atoms + i);
+        }
+        else if (x->oracle->interner != NULL)
+        {
+            t_atom event;
+            SETFLOAT(&event, words[i].w_float);
+            transition = internEvent(x->oracle->interner, &event, 1, x->dense_alphabet_size);
+            if (transition == -1)
+            {
+                pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+                break;
+            }
+        }
+        else
+        {
+            transition = (long)words[i].w_float;
+        }
+        
+        if (!transitionInRange(x->oracle, transition))
+        {
+            skipped++;
+        }
+        else if (windowFull(x))
+        {
+            continue;
+        }
+        else if (buildOracle(transition, x->oracle) == 0)
+        {
+            x->oracle->input_index += 1;
+            added++;
+            slideWindow(x);
+        }
+        else
+        {
+            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+            break;
+        }
+    }
+    
+    if (skipped > 0)
+    {
+        pd_error((t_object *)x, "Skipped %ld of %ld values that are not valid input.", skipped, count);
+    }
+    return added;
+}
+
+
+
+
+// With -audio, adds count / frame_dim frames of features taken from either atoms or words.
+void addFrames(t_factorOracle *x, const t_atom *atoms, const t_word *words, long count)
+{
+    if (!canWrite(x))
+    {
+        return;
+    }
+    t_oracle *o = x->oracle;
+    if (count < 1 || count % o->frame_dim != 0)
+    {
+        pd_error((t_object *)x, "A frame needs %ld features.", o->frame_dim);
+        return;
+    }
+    long frames = count / o->frame_dim;
+    if (reserveFrames(o, o->input_index + frames) != 0 || reserveStates(o, o->input_index + frames + 1) != 0)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        return;
+    }
+    
+    for (long f = 0; f < frames; f++)
+    {
+        float *frame = o->frames + o->input_index * o->frame_stride;
+        for (long i = 0; i < o->frame_dim; i++)
+        {
+            long j = f * o->frame_dim + i;
+            frame[i] = (atoms != NULL) ? atom_getfloat(atoms + j) : words[j].w_float;
+        }
+        if (buildOracle(o->input_index, o) != 0)
+        {
+            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+            break;
+        }
+        o->input_index += 1;
+    }
+}
+
+
+
+
+// With -intern, a float, a symbol, a list or any other message is one event, and its id is added.
+void addEvent(t_factorOracle *x, const t_atom *event, long n)
+{
+    if (!canWrite(x))
+    {
+        return;
+    }
+    if (n < 1 || n > INTERN_EVENT_MAX)
+    {
+        pd_error((t_object *)x, "An event must have 1 to %d elements.", INTERN_EVENT_MAX);
+        return;
+    }
+    for (long i = 0; i < n; i++)
+    {
+        if (event[i].a_type != A_FLOAT && event[i].a_type != A_SYMBOL)
+        {
+            pd_error((t_object *)x, "An event can only hold floats and symbols.");
+            return;
+        }
+    }
+    
+    long id = internEvent(x->oracle->interner, event, n, x->dense_alphabet_size);
+    if (id == -1)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+    }
+    else if (id == -2)
+    {
+        pd_error((t_object *)x, "The alphabet is full: -alphabet %ld allows %ld distinct events.", x->dense_alphabet_size, x->dense_alphabet_size);
+    }
+    else
+    {
+        addTransition(x, id);
+    }
+}
+
+
+
+
+// Outputs the input symbol id, with -intern the event it stands for, and with -audio its frame.
+static void outputEvent(t_factorOracle *x, long id)
+{
+    t_oracle *o = x->oracle;
+    if (o->frame_dim > 0 && id >= 0 && id < o->input_index)
+    {
+        if (reserveAtoms(&x->frame_atoms, &x->frame_atoms_size, o->frame_dim) != 0)
+        {
+            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+            return;
+        }
+        const float *frame = o->frames + id * o->frame_stride;
+        for (long i = 0; i < o->frame_dim; i++)
+        {
+            SETFLOAT(x->frame_atoms + i, frame[i]);
+        }
+        outlet_list(x->m_outlet10, &s_list, (int)o->frame_dim, x->frame_atoms);
+        return;
+    }
+    
+    t_interner *t = x->oracle->interner;
+    if (t == NULL || id < 0 || id >= t->count)
+    {
+        outlet_float(x->m_outlet10, id);
+        return;
+    }
+    
+    // Copied, since whatever the event triggers may add events and move the table.
+    long n;
+    const t_atom *stored = internedEvent(t, id, &n);
+    t_atom event[INTERN_EVENT_MAX];
+    memcpy(event, stored, n * sizeof(t_atom));
+    if (n == 1 && event->a_type == A_FLOAT)
+    {
+        outlet_float(x->m_outlet10, event->a_w.w_float);
+    }
+    else if (n == 1)
+    {
+        outlet_symbol(x->m_outlet10, event->a_w.w_symbol);
+    }
+    else
+    {
+        outlet_list(x->m_outlet10, &s_list, (int)n, event);
+    }
+}
+
+
+
+
+// Outputs count symbol ids as one list, or with -intern or -audio the events they stand for one by one.
+static void outputEvents(t_factorOracle *x, t_atom *symbols, long count)
+{
+    if (x->oracle->interner == NULL && x->oracle->frame_dim == 0)
+    {
+        outlet_list(x->m_outlet10, &s_list, (int)count, symbols);
+        return;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        outputEvent(x, (long)atom_getfloat(symbols + i));
+    }
+}
+
+
+
+
+void factorOracle_list(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->oracle->frame_dim > 0)
+    {
+        addFrames(x, argv, NULL, argc);
+        return;
+    }
+    if (x->oracle->interner != NULL)
+    {
+        addEvent(x, argv, argc);
+        return;
+    }
+    addTransitions(x, argv, NULL, argc);
+}
+
+
+
+
+void factorOracle_symbol(t_factorOracle *x, t_symbol *s)
+{
+    if (x->oracle->interner == NULL)
+    {
+        pd_error((t_object *)x, "Symbol input needs the -intern flag.");
+        return;
+    }
+    t_atom event;
+    SETSYMBOL(&event, s);
+    addEvent(x, &event, 1);
+}
+
+
+
+
+void factorOracle_add(t_factorOracle *x, t_symbol *s)
+{
+    t_garray *a = (t_garray *)pd_findbyclass(s, garray_class);
+    if (a == NULL)
+    {
+        pd_error((t_object *)x, "%s: no such array", s->s_name);
+        return;
+    }
+    
+    int size;
+    t_word *vec;
+    if (!garray_getfloatwords(a, &size, &vec))
+    {
+        pd_error((t_object *)x, "%s: bad template for factorOracle", s->s_name);
+        return;
+    }
+    if (x->oracle->frame_dim > 0)
+    {
+        addFrames(x, NULL, vec, size);
+        return;
+    }
+    addTransitions(x, NULL, vec, size);
+}
+
+
+
+
+void factorOracle_float(t_factorOracle *x, float transition)
+{
+    if (x->oracle->frame_dim > 0)
+    {
+        t_atom feature;
+        SETFLOAT(&feature, transition);
+        addFrames(x, &feature, NULL, 1);
+    }
+    else if (x->oracle->interner != NULL)
+    {
+        t_atom event;
+        SETFLOAT(&event, transition);
+        addEvent(x, &event, 1);
+    }
+    else if (validTransition(x, (long)transition))
+    {
+        addTransition(x, (long)transition);
+    }
+}
+
+
+
+
+void factorOracle_mode(t_factorOracle *x, float mode)
+{
+    long m = (long)mode;
+    if (m < 0)
+    {
+        x->mode = 0;
+    }
+    else if (m > 2)
+    {
+        x->mode = 2;
+    }
+    else
+    {
+        x->mode = m;
+    }
+}
+
+
+
+
+void factorOracle_clear(t_factorOracle *x)
+{
+    if (!canWrite(x))
+    {
+        return;
+    }
+    cancelWindow(x);
+    arena_reset(&x->oracle->arena);
+    resetAlphabet(x->oracle);
+    if (x->oracle->interner != NULL)
+    {
+        interner_reset(x->oracle->interner);
+    }
+    x->oracle->input_index = 0;
+    for (t_factorOracle *u = oracleUsers(x); u != NULL; u = u->next_user)
+    {
+        for (long i = 0; i < u->voice_count; i++)
+        {
+            u->voices[i].output_state = -1;
+            u->voices[i].jump_pending = 0;
+        }
+        flushSignal(u);
+    }
+}
+
+
+
+
+// JSON is streamed through a fixed buffer, so exporting needs the same small amount of memory whatever
+// the size of the oracle. Each state becomes "state":[{"end state":"symbol",...},"suffix link"].
+#define JSON_BUFFER_SIZE 65536
+
+typedef struct _jsonwriter
+{
+    FILE *file;
+    size_t used;
+    int failed;
+    char buffer[JSON_BUFFER_SIZE];
+} t_jsonwriter;
+
+
+
+
+static void jsonFlush(t_jsonwriter *w)
+{
+    if (w->used > 0 && !w->failed && fwrite(w->buffer, 1, w->used, w->file) != w->used)
+    {
+        w->failed = 1;
+    }
+    w->used = 0;
+}
+
+
+
+
+static void jsonText(t_jsonwriter *w, const char *text, size_t length)
+{
+    if (w->used + length > JSON_BUFFER_SIZE)
+    {
+        jsonFlush(w);
+    }
+    memcpy(w->buffer + w->used, text, length);
+    w->used += length;
+}
+
+
+
+
+// Writes n as a quoted decimal, without going through printf.
+static void jsonNumber(t_jsonwriter *w, long n)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    unsigned long magnitude = (n < 0) ? 0UL - (unsigned long)n : (unsigned long)n;
+    *--p = '"';
+    do
+    {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (n < 0)
+    {
+        *--p = '-';
+    }
+    *--p = '"';
+    jsonText(w, p, digits + sizeof(digits) - p);
+}
+
+
+
+
+long json(t_factorOracle *x, t_symbol *s)
+{
+    char path[MAXPDSTRING];
+    canvas_makefilename(x->canvas, s->s_name, path, MAXPDSTRING);
+    t_jsonwriter *w = getbytes(sizeof(t_jsonwriter));
+    if (w == NULL)
+    {
+        post("%s", MEMORY_ALLOCATION_ERROR);
+        return -1;
+    }
+    w->file = sys_fopen(path, "wb");
+    if (w->file == NULL)
+    {
+        pd_error((t_object *)x, "Unable to open %s for writing.", path);
+        freebytes(w, sizeof(t_jsonwriter));
+        return -1;
+    }
+    
+    jsonText(w, "{\n", 2);
+    for (long i = 0; i <= x->oracle->input_index; i++)
+    {
+        if (i > 0)
+        {
+            jsonText(w, ",\n", 2);
+        }
+        jsonNumber(w, i);
+        jsonText(w, ":[{", 3);
+        long count = STATE(x->oracle, edgeCount, i);
+        t_foindex *end_states = (count > 0) ? transitionEndStates(x->oracle, i) : NULL;
+        t_foindex *symbols = (count > 0) ? transitionSymbols(x->oracle, i) : NULL;
+        for (long j = 0; j < count; j++)
+        {
+            if (j > 0)
+            {
+                jsonText(w, ",", 1);
+            }
+            jsonNumber(w, end_states[j]);
+            jsonText(w, ":", 1);
+            jsonNumber(w, symbols[j]);
+        }
+        jsonText(w, "},", 2);
+        jsonNumber(w, STATE(x->oracle, suffixLink, i));
+        jsonText(w, "]", 1);
+    }
+    jsonText(w, "\n}", 2);
+    jsonFlush(w);
+    
+    long failed = w->failed;
+    if (sys_fclose(w->file) != 0 || failed)
+    {
+        pd_error((t_object *)x, "Unable to write %s.", path);
+        failed = 1;
+    }
+    freebytes(w, sizeof(t_jsonwriter));
+    return failed ? -1 : 0;
+}
+
+
+
+
+void factorOracle_json(t_factorOracle *x, t_symbol *s)
+{
+    if (x->oracle->input_index < 1)
+    {
+        pd_error((t_object *)x, "%s", EMPTY_ORACLE_ERROR);
+        return;
+    }
+    json(x, s);
+}
+
+
+
+
+void factorOracle_dowrite(t_factorOracle *x, t_symbol *s)
+{
+    if (x->oracle->input_index < 1)
+    {
+        pd_error((t_object *)x, "%s", EMPTY_ORACLE_ERROR);
+    }
+    else if (x->oracle->interner != NULL || x->oracle->frame_dim > 0)
+    {
+        pd_error((t_object *)x, "write only stores numbers, not the events of -intern or the frames of -audio.");
+    }
+    else
+    {
+        t_binbuf *b = binbuf_new();
+        long size = x->oracle->input_index * sizeof(t_atom);
         t_atom *argv = getbytes(size);
-        for (long i = 0; i < x->input_index; i++)
+        for (long i = 0; i < x->oracle->input_index; i++)
+        {
+            SETFLOAT(&argv[i], STATE(x->oracle, symbol, i));
+        }
+        binbuf_add(b, (int)x->oracle->input_index, argv);
+        binbuf_write(b, s->s_name, x->canvas_dir->s_name, 1);
+        freebytes(b, size);
+    }
+
+}
+
+
+
+
+// Returns the first object walking the oracle of x. The others follow through next_user.
+static t_factorOracle *oracleUsers(t_factorOracle *x)
+{
+    return (x->shared != NULL) ? x->shared->users : x;
+}
+
+
+
+
+// Only the writer of a shared oracle may change it; a message that would is refused for the others.
+static int canWrite(t_factorOracle *x)
+{
+    if (x->shared != NULL && x->shared->users != x)
+    {
+        pd_error((t_object *)x, "The oracle '%s' is written by another object.", x->shared->name->s_name);
+        return 0;
+    }
+    return 1;
+}
+
+
+
+
+static void setOracle(t_factorOracle *x, t_oracle *o)
+{
+    if (x->shared != NULL)
+    {
+        x->shared->oracle = o;
+    }
+    for (t_factorOracle *u = oracleUsers(x); u != NULL; u = u->next_user)
+    {
+        u->oracle = o;
+    }
+}
+
+
+
+
+// Returns the oracle bound to name, creating it if x is its first user.
+t_oracle *shareOracle(t_factorOracle *x, t_symbol *name)
+{
+    t_sharedoracle *e = (t_sharedoracle *)pd_findbyclass(name, sharedoracle_class);
+    if (e == NULL)
+    {
+        e = (t_sharedoracle *)pd_new(sharedoracle_class);
+        if (e == NULL)
+        {
+            return NULL;
+        }
+        e->oracle = oracle_new(x->dense_alphabet_size);
+        if (e->oracle == NULL)
+        {
+            pd_free(&e->s_pd);
+            return NULL;
+        }
+        e->name = name;
+        e->users = NULL;
+        e->refcount = 0;
+        pd_bind(&e->s_pd, name);
+    }
+    else if (e->oracle->dense_alphabet_size != x->dense_alphabet_size)
+    {
+        pd_error((t_object *)x, "The oracle '%s' was created with -alphabet %ld.", name->s_name, e->oracle->dense_alphabet_size);
+        x->dense_alphabet_size = e->oracle->dense_alphabet_size;
+    }
+    
+    t_factorOracle **last = &e->users;
+    while (*last != NULL)
+    {
+        last = &(*last)->next_user;
+    }
+    *last = x;
+    x->next_user = NULL;
+    x->shared = e;
+    e->refcount++;
+    return e->oracle;
+}
+
+
+
+
+// Lets go of the oracle of x, which is freed once nothing uses it.
+void unshareOracle(t_factorOracle *x)
+{
+    t_sharedoracle *e = x->shared;
+    if (e == NULL)
+    {
+        oracle_free(x->oracle);
+        return;
+    }
+    
+    t_factorOracle **u = &e->users;
+    while (*u != x)
+    {
+        u = &(*u)->next_user;
+    }
+    *u = x->next_user;
+    x->shared = NULL;
+    if (--e->refcount == 0)
+    {
+        pd_unbind(&e->s_pd, e->name);
+        oracle_free(e->oracle);
+        pd_free(&e->s_pd);
+    }
+}
+
+
+
+
+// Replaces the oracle and clears what was derived from the old one.
+void swapOracle(t_factorOracle *x, t_oracle *o)
+{
+    factorOracle_clear(x);
+    oracle_free(x->oracle);
+    setOracle(x, o);
+}
+
+
+
+
+static int loadCancelled(t_loadjob *job)
+{
+    pthread_mutex_lock(&job->lock);
+    int cancel = job->cancel;
+    pthread_mutex_unlock(&job->lock);
+    return cancel;
+}
+
+
+
+
+// Reads whitespace, comma or semicolon separated numbers, as written by write, and builds them into
+// job->oracle. Returns -1 if memory ran out.
+static int readSymbols(t_loadjob *job)
+{
+    t_oracle *o = job->oracle;
+    char token[64];
+    int length = 0;
+    int failed = 0;
+    int c;
+    do
+    {
+        c = getc(job->file);
+        if (c != EOF && c != ';' && c != ',' && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+        {
+            if (length < (int)sizeof(token) - 1)
+            {
+                token[length] = (char)c;
+            }
+            length++;
+            continue;
+        }
+        if (length == 0)
+        {
+            continue;
+        }
+        
+        job->total++;
+        char *end;
+        token[(length < (int)sizeof(token)) ? length : (int)sizeof(token) - 1] = 0;
+        double value = strtod(token, &end);
+        long transition = (long)value;
+        // A token is checked in full before it is interned, so rejected input takes no id. NaN is
+        // rejected as it never equals itself.
+        int valid = (length < (int)sizeof(token) && *end == 0 && value == value);
+        if (valid && o->interner != NULL)
+        {
+            t_atom event;
+            SETFLOAT(&event, value);
+            transition = internEvent(o->interner, &event, 1, o->dense_alphabet_size);
+            if (transition == -1)
+            {
+                failed = -1;
+                break;
+            }
+            valid = (transition >= 0);
+        }
+        else if (valid)
+        {
+            valid = (value >= FOINDEX_MIN && value <= FOINDEX_MAX && transitionInRange(o, transition));
+        }
+        if (!valid)
+        {
+            job->skipped++;
+        }
+        else if (buildOracle(transition, o) == 0)
+        {
+            o->input_index += 1;
+        }
+        else
+        {
+            failed = -1;
+            break;
+        }
+        length = 0;
+        
+        if ((job->total & 4095) == 0 && loadCancelled(job))
+        {
+            break;
+        }
+    } while (c != EOF);
+    
+    fclose(job->file);
+    return failed;
+}
+
+
+
+
+// Builds the symbols copied out of a windowed oracle into job->oracle.
+static int buildSymbols(t_loadjob *job)
+{
+    t_oracle *o = job->oracle;
+    for (long i = 0; i < job->symbol_count; i++)
+    {
+        if (buildOracle(job->symbols[i], o) != 0)
+        {
+            return -1;
+        }
+        o->input_index += 1;
+        if ((i & 4095) == 4095 && loadCancelled(job))
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+
+
+
+// Runs on the worker thread, so it uses neither the Pd API nor the object.
+static void *loadWorker(void *arg)
+{
+    t_loadjob *job = (t_loadjob *)arg;
+    int failed = (job->file != NULL) ? readSymbols(job) : buildSymbols(job);
+    pthread_mutex_lock(&job->lock);
+    job->failed = (failed != 0);
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+
+
+
+static int loadDone(t_loadjob *job)
+{
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+
+
+
+static int startLoad(t_factorOracle *x, t_loadjob *job)
+{
+    pthread_mutex_init(&job->lock, NULL);
+    if (pthread_create(&job->thread, NULL, loadWorker, job) != 0)
+    {
+        pthread_mutex_destroy(&job->lock);
+        return -1;
+    }
+    x->load = job;
+    clock_delay(x->load_clock, LOAD_POLL_INTERVAL);
+    return 0;
+}
+
+
+
+
+static void freeLoad(t_factorOracle *x)
+{
+    pthread_join(x->load->thread, NULL);
+    pthread_mutex_destroy(&x->load->lock);
+    freebytes(x->load->symbols, x->load->symbol_count * sizeof(t_foindex));
+    freebytes(x->load, sizeof(t_loadjob));
+    x->load = NULL;
+}
+
+
+
+
+static void cancelLoad(t_factorOracle *x)
+{
+    if (x->load == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&x->load->lock);
+    x->load->cancel = 1;
+    pthread_mutex_unlock(&x->load->lock);
+    t_oracle *o = x->load->oracle;
+    freeLoad(x);
+    oracle_free(o);
+}
+
+
+
+
+// Drops a running window rebuild, whose copy of the input no longer matches the oracle.
+static void cancelWindow(t_factorOracle *x)
+{
+    if (x->load != NULL && x->load->symbols != NULL)
+    {
+        cancelLoad(x);
+    }
+}
+
+
+
+
+// Starts a background pass that appends count inputs of the current oracle, from input from on, to o,
+// a rebuild of the window that starts at input first. Returns -1 if it could not be started.
+static int startRebuild(t_factorOracle *x, t_oracle *o, long from, long count, long first)
+{
+    t_loadjob *job = getbytes(sizeof(t_loadjob));
+    t_foindex *symbols = getbytes(count * sizeof(t_foindex));
+    if (job == NULL || symbols == NULL)
+    {
+        freebytes(job, sizeof(t_loadjob));
+        freebytes(symbols, count * sizeof(t_foindex));
+        return -1;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        symbols[i] = STATE(x->oracle, symbol, from + i);
+    }
+    job->oracle = o;
+    job->symbols = symbols;
+    job->symbol_count = count;
+    job->first = first;
+    if (startLoad(x, job) != 0)
+    {
+        freebytes(job, sizeof(t_loadjob));
+        freebytes(symbols, count * sizeof(t_foindex));
+        return -1;
+    }
+    return 0;
+}
+
+
+
+
+// Starts rebuilding the last window inputs into a fresh oracle once the current one holds twice that
+// many, so eviction costs O(1) per input on average. The scheduler never waits for a rebuild: see
+// windowFull() for input that outpaces it.
+static void slideWindow(t_factorOracle *x)
+{
+    long n = x->oracle->input_index;
+    if (x->window < 1 || x->load != NULL || n < 2 * x->window)
+    {
+        return;
+    }
+    
+    t_oracle *o = oracle_new(x->dense_alphabet_size);
+    if (o == NULL || startRebuild(x, o, n - x->window, x->window, n - x->window) != 0)
+    {
+        oracle_free(o);
+        pd_error((t_object *)x, "Unable to start a window rebuild.");
+    }
+}
+
+
+
+
+// Returns 1 if the next input has to be dropped: the oracle holds three windows and the rebuild that
+// will shrink it is still running. A rebuild that has just finished is swapped in first. Dropping is what
+// bounds the memory in use, and it only happens when input comes faster than a background pass builds it.
+static int windowFull(t_factorOracle *x)
+{
+    if (x->window < 1 || x->load == NULL || x->load->symbols == NULL || x->oracle->input_index < 3 * x->window)
+    {
+        return 0;
+    }
+    if (loadDone(x->load))
+    {
+        finishLoad(x);
+    }
+    if (x->load != NULL && x->load->symbols != NULL && x->oracle->input_index >= 3 * x->window)
+    {
+        x->window_dropped++;
+        return 1;
+    }
+    return 0;
+}
+
+
+
+
+// Swaps in a rebuilt window. Inputs that arrived during the rebuild are added to it first: a few here,
+// more in another background pass. The output state moves to the same place in the input, or restarts
+// if that has been evicted.
+static void windowRebuilt(t_factorOracle *x, t_oracle *o, long first)
+{
+    long pending = x->oracle->input_index - (first + o->input_index);
+    if (pending > WINDOW_CATCHUP)
+    {
+        if (startRebuild(x, o, first + o->input_index, pending, first) != 0)
+        {
+            oracle_free(o);
+            pd_error((t_object *)x, "Unable to start a window rebuild.");
+        }
+        return;
+    }
+    if (x->window_dropped > 0)
+    {
+        pd_error((t_object *)x, "Dropped %ld inputs that came faster than the window could be rebuilt.", x->window_dropped);
+        x->window_dropped = 0;
+    }
+    for (long i = first + o->input_index; i < x->oracle->input_index; i++)
+    {
+        if (buildOracle(STATE(x->oracle, symbol, i), o) != 0)
+        {
+            pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+            oracle_free(o);
+            return;
+        }
+        o->input_index += 1;
+    }
+    
+    o->interner = x->oracle->interner;
+    x->oracle->interner = NULL;
+    oracle_free(x->oracle);
+    setOracle(x, o);
+    for (t_factorOracle *u = oracleUsers(x); u != NULL; u = u->next_user)
+    {
+        for (long i = 0; i < u->voice_count; i++)
+        {
+            t_voice *v = u->voices + i;
+            v->output_state = (v->output_state >= first) ? v->output_state - first : -1;
+        }
+        if (u->dsp != NULL)
+        {
+            t_voice *v = &u->dsp->voice;
+            v->output_state = (v->output_state >= first) ? v->output_state - first : -1;
+        }
+    }
+}
+
+
+
+
+// Waits for the worker and swaps its oracle in. A finished read also outputs "read <inputs>" from the
+// rightmost outlet.
+static void finishLoad(t_factorOracle *x)
+{
+    clock_unset(x->load_clock);
+    t_oracle *o = x->load->oracle;
+    int failed = x->load->failed;
+    int rebuild = (x->load->symbols != NULL);
+    long first = x->load->first;
+    long total = x->load->total;
+    long skipped = x->load->skipped;
+    freeLoad(x);
+    if (failed)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        oracle_free(o);
+        return;
+    }
+    if (rebuild)
+    {
+        windowRebuilt(x, o, first);
+        slideWindow(x);
+        return;
+    }
+    if (skipped > 0)
+    {
+        pd_error((t_object *)x, "Skipped %ld of %ld values that are not valid input.", skipped, total);
+    }
+    
+    swapOracle(x, o);
+    t_atom out;
+    SETFLOAT(&out, o->input_index);
+    outlet_anything(x->m_outlet7, gensym("read"), 1, &out);
+    slideWindow(x);
+}
+
+
+
+
+// Polls the worker from the Pd thread.
+void factorOracle_loaded(t_factorOracle *x)
+{
+    if (x->load == NULL)
+    {
+        return;
+    }
+    if (loadDone(x->load))
+    {
+        finishLoad(x);
+    }
+    else
+    {
+        clock_delay(x->load_clock, LOAD_POLL_INTERVAL);
+    }
+}
+
+
+
+
+// Starts reading s on a worker thread. The file is opened here, where the canvas search path can be used.
+void factorOracle_doread(t_factorOracle *x, t_symbol *s) {
+    if (!canWrite(x))
+    {
+        return;
+    }
+    if (x->oracle->frame_dim > 0)
+    {
+        pd_error((t_object *)x, "read only reads numbers, not the frames of -audio.");
+        return;
+    }
+    cancelWindow(x);
+    if (x->load != NULL)
+    {
+        pd_error((t_object *)x, "A read is already in progress.");
+        return;
+    }
+    
+    char dir[MAXPDSTRING], *name;
+    int fd = canvas_open(x->canvas, s->s_name, "", dir, &name, MAXPDSTRING, 0);
+    FILE *file = (fd >= 0) ? fdopen(fd, "r") : NULL;
+    if (file == NULL)
+    {
+        if (fd >= 0)
+        {
+            sys_close(fd);
+        }
+        pd_error((t_object *)x, "Unable to open %s.", s->s_name);
+        return;
+    }
+    
+    t_loadjob *job = getbytes(sizeof(t_loadjob));
+    t_oracle *o = oracle_new(x->dense_alphabet_size);
+    if (o != NULL && x->oracle->interner != NULL)
+    {
+        o->interner = interner_new();
+    }
+    if (job == NULL || o == NULL || (x->oracle->interner != NULL && o->interner == NULL))
+    {
+        freebytes(job, sizeof(t_loadjob));
+        oracle_free(o);
+        fclose(file);
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        return;
+    }
+    job->file = file;
+    job->oracle = o;
+    if (startLoad(x, job) != 0)
+    {
+        freebytes(job, sizeof(t_loadjob));
+        oracle_free(o);
+        fclose(file);
+        pd_error((t_object *)x, "Unable to start reading %s.", s->s_name);
+    }
+}
+
+
+
+
+// Snapshots hold the finished graph: the state pages and the arena chunks with the transitions, byte for
+// byte, so that loading is a single mmap (or one read on Windows) and no rebuild. Arena handles are
+// relative to their chunk, so they stay valid wherever the chunks end up. The header records everything
+// the layout depends on; a snapshot only loads into a build and an object with the same settings. The
+// alphabet follows the chunks as (symbol, count) pairs, so that loading does not recount the input.
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 4096
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct _snapshotheader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t index_bytes;
+    uint32_t page_shift;
+    uint32_t offset_bits;
+    uint32_t chunk_count;
+    int64_t input_index;
+    int64_t dense_alphabet_size;
+    int64_t state_page_count;
+    int64_t alphabet_size;
+    uint64_t arena_used;
+    uint32_t free_list[ARENA_SIZE_CLASSES];
+} t_snapshotheader;
+
+static const char SNAPSHOT_MAGIC[8] = "foracle";
+
+
+
+
+static size_t snapshotAlign(size_t offset)
+{
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+}
+
+
+
+
+static void snapshotHeader(t_factorOracle *x, t_snapshotheader *h)
+{
+    memset(h, 0, sizeof(t_snapshotheader));
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->version = SNAPSHOT_VERSION;
+    h->byte_order = SNAPSHOT_BYTE_ORDER;
+    h->index_bytes = sizeof(t_foindex);
+    h->page_shift = STATE_PAGE_SHIFT;
+    h->offset_bits = ARENA_OFFSET_BITS;
+    h->chunk_count = (uint32_t)((x->oracle->arena.chunk_count > 0) ? x->oracle->arena.current + 1 : 0);
+    h->input_index = x->oracle->input_index;
+    h->dense_alphabet_size = x->dense_alphabet_size;
+    h->state_page_count = (x->oracle->input_index + STATE_PAGE_SIZE) >> STATE_PAGE_SHIFT;
+    h->alphabet_size = x->oracle->alphabet_size;
+    h->arena_used = x->oracle->arena.used;
+    for (int i = 0; i < ARENA_SIZE_CLASSES; i++)
+    {
+        h->free_list[i] = x->oracle->arena.free_list[i];
+    }
+}
+
+
+
+
+void factorOracle_save(t_factorOracle *x, t_symbol *s)
+{
+    if (x->oracle->input_index < 1)
+    {
+        pd_error((t_object *)x, "%s", EMPTY_ORACLE_ERROR);
+        return;
+    }
+    if (x->oracle->interner != NULL || x->oracle->frame_dim > 0)
+    {
+        pd_error((t_object *)x, "Snapshots do not hold the events of -intern or the frames of -audio.");
+        return;
+    }
+    
+    char path[MAXPDSTRING];
+    canvas_makefilename(x->canvas, s->s_name, path, MAXPDSTRING);
+    FILE *file = sys_fopen(path, "wb");
+    if (file == NULL)
+    {
+        pd_error((t_object *)x, "Unable to open %s for writing.", path);
+        return;
+    }
+    
+    t_snapshotheader h;
+    snapshotHeader(x, &h);
+    int failed = (fwrite(&h, sizeof(h), 1, file) != 1);
+    size_t offset = sizeof(h);
+    for (uint32_t i = 0; i < h.chunk_count && !failed; i++)
+    {
+        uint64_t size = x->oracle->arena.chunks[i].size;
+        failed = (fwrite(&size, sizeof(size), 1, file) != 1);
+        offset += sizeof(size);
+    }
+    
+    static const char padding[SNAPSHOT_ALIGN];
+    if (!failed)
+    {
+        failed = (fwrite(padding, 1, snapshotAlign(offset) - offset, file) != snapshotAlign(offset) - offset);
+    }
+    for (int64_t i = 0; i < h.state_page_count && !failed; i++)
+    {
+        failed = (fwrite(x->oracle->state_pages[i], sizeof(t_statepage), 1, file) != 1);
+    }
+    for (uint32_t i = 0; i < h.chunk_count && !failed; i++)
+    {
+        failed = (fwrite(x->oracle->arena.chunks[i].base, x->oracle->arena.chunks[i].size, 1, file) != 1);
+    }
+    for (int64_t i = 0; i < h.alphabet_size && !failed; i++)
+    {
+        int64_t pair[2] = { x->oracle->alphabet[i], x->oracle->alphabet_counts[i] };
+        failed = (fwrite(pair, sizeof(pair), 1, file) != 1);
+    }
+    
+    if (sys_fclose(file) != 0 || failed)
+    {
+        pd_error((t_object *)x, "Unable to write %s.", path);
+    }
+}
+
+
+
+
+// Maps the whole file privately: pages are shared with the page cache until the oracle writes to them,
+// which only happens when it grows, and the file itself is never modified. Startup costs the page faults
+// the first walks touch instead of a rebuild.
+static char *mapSnapshot(int fd, size_t size)
+{
+#ifdef _WIN32
+    char *data = getbytes(size);
+    size_t done = 0;
+    while (data != NULL && done < size)
+    {
+        int n = read(fd, data + done, (unsigned int)(size - done));
+        if (n <= 0)
+        {
+            freebytes(data, size);
+            return NULL;
+        }
+        done += n;
+    }
+    return data;
+#else
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    return (data == MAP_FAILED) ? NULL : data;
+#endif
+}
+
+
+
+
+static void unmapSnapshot(char *data, size_t size)
+{
+#ifdef _WIN32
+    freebytes(data, size);
+#else
+    munmap(data, size);
+#endif
+}
+
+
+
+
+static void releaseSnapshot(t_oracle *o)
+{
+    if (o->snapshot == NULL)
+    {
+        return;
+    }
+    unmapSnapshot(o->snapshot, o->snapshot_size);
+    o->snapshot = NULL;
+    o->snapshot_size = 0;
+    o->snapshot_pages = 0;
+}
+
+
+
+
+t_oracle *oracle_new(long dense_alphabet_size)
+{
+    t_oracle *o = getbytes(sizeof(t_oracle));
+    if (o == NULL)
+    {
+        return NULL;
+    }
+    o->state_pages = NULL;
+    o->state_page_count = 0;
+    o->state_page_limit = 0;
+    arena_init(&o->arena);
+    o->input_index = 0;
+    o->dense_alphabet_size = dense_alphabet_size;
+    o->alphabet = NULL;
+    o->alphabet_counts = NULL;
+    o->alphabet_size = 0;
+    o->alphabet_limit = 0;
+    o->alphabet_index = NULL;
+    o->interner = NULL;
+    o->frames = NULL;
+    o->frame_block = NULL;
+    o->frame_dim = 0;
+    o->frame_stride = 0;
+    o->frame_limit = 0;
+    o->frame_threshold = 0;
+    o->snapshot = NULL;
+    o->snapshot_size = 0;
+    o->snapshot_pages = 0;
+    return o;
+}
+
+
+
+
+// Frees the states and transitions, including a loaded snapshot, and the oracle itself.
+void oracle_free(t_oracle *o)
+{
+    if (o == NULL)
+    {
+        return;
+    }
+    arena_free(&o->arena);
+    freePages((void ***)&o->state_pages, &o->state_page_count, &o->state_page_limit, sizeof(t_statepage), o->snapshot_pages);
+    releaseSnapshot(o);
+    freebytes(o->alphabet, o->alphabet_limit * sizeof(t_foindex));
+    freebytes(o->alphabet_counts, o->alphabet_limit * sizeof(long));
+    freebytes(o->alphabet_index, 2 * o->alphabet_limit * sizeof(t_foindex));
+    interner_free(o->interner);
+    freeFrames(o);
+    freebytes(o, sizeof(t_oracle));
+}
+
+
+
+
+static int validSnapshot(t_factorOracle *x, const t_snapshotheader *h, size_t size)
+{
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->byte_order != SNAPSHOT_BYTE_ORDER)
+    {
+        pd_error((t_object *)x, "Not a factorOracle snapshot.");
+        return 0;
+    }
+    if (h->version != SNAPSHOT_VERSION)
+    {
+        pd_error((t_object *)x, "Unsupported snapshot version %u.", h->version);
+        return 0;
+    }
+    if (h->index_bytes != sizeof(t_foindex) || h->page_shift != STATE_PAGE_SHIFT || h->offset_bits != ARENA_OFFSET_BITS)
+    {
+        pd_error((t_object *)x, "The snapshot was saved by a different build of factorOracle.");
+        return 0;
+    }
+    if (h->dense_alphabet_size != x->dense_alphabet_size)
+    {
+        pd_error((t_object *)x, "The snapshot was saved with -alphabet %ld.", (long)h->dense_alphabet_size);
+        return 0;
+    }
+    if (h->input_index < 1 || h->state_page_count != ((h->input_index + STATE_PAGE_SIZE) >> STATE_PAGE_SHIFT) || h->chunk_count < 1 || h->chunk_count > ARENA_MAX_CHUNKS
+        || h->alphabet_size < 1 || h->alphabet_size > h->input_index)
+    {
+        pd_error((t_object *)x, "The snapshot is damaged.");
+        return 0;
+    }
+    
+    size_t needed = snapshotAlign(sizeof(t_snapshotheader) + h->chunk_count * sizeof(uint64_t));
+    if (needed > size)
+    {
+        pd_error((t_object *)x, "The snapshot is damaged.");
+        return 0;
+    }
+    const uint64_t *chunk_size = (const uint64_t *)(h + 1);
+    needed += h->state_page_count * sizeof(t_statepage);
+    for (uint32_t i = 0; i < h->chunk_count; i++)
+    {
+        needed += chunk_size[i];
+    }
+    needed += h->alphabet_size * 2 * sizeof(int64_t);
+    if (needed != size || h->arena_used > chunk_size[h->chunk_count - 1])
+    {
+        pd_error((t_object *)x, "The snapshot is damaged.");
+        return 0;
+    }
+    return 1;
+}
+
+
+
+
+// Fills the empty alphabet of o from count (symbol, count) pairs of a snapshot. Costs the size of the
+// alphabet, not of the input.
+static int restoreAlphabet(t_oracle *o, const char *pairs, long count)
+{
+    while (o->alphabet_limit < count)
+    {
+        if (growAlphabet(o) != 0)
+        {
+            return -1;
+        }
+    }
+    for (long i = 0; i < count; i++)
+    {
+        int64_t pair[2];
+        memcpy(pair, pairs + i * sizeof(pair), sizeof(pair));
+        o->alphabet[i] = (t_foindex)pair[0];
+        o->alphabet_counts[i] = (long)pair[1];
+        o->alphabet_index[alphabetSlot(o, pair[0])] = (t_foindex)(i + 1);
+    }
+    o->alphabet_size = count;
+    return 0;
+}
+
+
+
+
+// Replaces the oracle with the one in the snapshot. The page directory and the chunk table are the only
+// allocations; states and transitions are used where they lie in the file.
+void factorOracle_load(t_factorOracle *x, t_symbol *s)
+{
+    if (!canWrite(x))
+    {
+        return;
+    }
+    if (x->oracle->interner != NULL || x->oracle->frame_dim > 0)
+    {
+        pd_error((t_object *)x, "Snapshots do not hold the events of -intern or the frames of -audio.");
+        return;
+    }
+    cancelWindow(x);
+    if (x->load != NULL)
+    {
+        pd_error((t_object *)x, "A read is in progress.");
+        return;
+    }
+    char dir[MAXPDSTRING], *name;
+    int fd = canvas_open(x->canvas, s->s_name, "", dir, &name, MAXPDSTRING, 1);
+    if (fd < 0)
+    {
+        pd_error((t_object *)x, "Unable to open %s.", s->s_name);
+        return;
+    }
+    
+    struct stat st;
+    char *data = NULL;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(t_snapshotheader))
+    {
+        size = (size_t)st.st_size;
+        data = mapSnapshot(fd, size);
+    }
+    sys_close(fd);
+    if (data == NULL)
+    {
+        pd_error((t_object *)x, "Unable to read %s.", s->s_name);
+        return;
+    }
+    
+    const t_snapshotheader *h = (const t_snapshotheader *)data;
+    if (!validSnapshot(x, h, size))
+    {
+        unmapSnapshot(data, size);
+        return;
+    }
+    
+    long page_limit = (h->state_page_count > 4) ? h->state_page_count : 4;
+    long chunk_limit = (h->chunk_count > 8) ? h->chunk_count : 8;
+    t_oracle *o = oracle_new(x->dense_alphabet_size);
+    t_statepage **pages = getbytes(page_limit * sizeof(t_statepage *));
+    t_arenachunk *chunks = getbytes(chunk_limit * sizeof(t_arenachunk));
+    if (o == NULL || pages == NULL || chunks == NULL)
+    {
+        oracle_free(o);
+        freebytes(pages, page_limit * sizeof(t_statepage *));
+        freebytes(chunks, chunk_limit * sizeof(t_arenachunk));
+        unmapSnapshot(data, size);
+        post("%s", MEMORY_ALLOCATION_ERROR);
+        return;
+    }
+    
+    const uint64_t *chunk_size = (const uint64_t *)(h + 1);
+    char *p = data + snapshotAlign(sizeof(t_snapshotheader) + h->chunk_count * sizeof(uint64_t));
+    for (long i = 0; i < h->state_page_count; i++)
+    {
+        pages[i] = (t_statepage *)p;
+        p += sizeof(t_statepage);
+    }
+    for (uint32_t i = 0; i < h->chunk_count; i++)
+    {
+        chunks[i].base = p;
+        chunks[i].size = chunk_size[i];
+        p += chunk_size[i];
+    }
+    
+    o->state_pages = pages;
+    o->state_page_count = h->state_page_count;
+    o->state_page_limit = page_limit;
+    o->arena.chunks = chunks;
+    o->arena.chunk_count = h->chunk_count;
+    o->arena.chunk_limit = chunk_limit;
+    o->arena.current = h->chunk_count - 1;
+    o->arena.used = h->arena_used;
+    o->arena.borrowed = h->chunk_count;
+    for (int i = 0; i < ARENA_SIZE_CLASSES; i++)
+    {
+        o->arena.free_list[i] = h->free_list[i];
+    }
+    o->input_index = h->input_index;
+    o->snapshot = data;
+    o->snapshot_size = size;
+    o->snapshot_pages = h->state_page_count;
+    if (restoreAlphabet(o, p, h->alphabet_size) != 0)
+    {
+        oracle_free(o);
+        post("%s", MEMORY_ALLOCATION_ERROR);
+        return;
+    }
+    swapOracle(x, o);
+}
+
+
+
+
+void factorOracle_anything(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (s == gensym("read"))
+    {
+        if (argc == 0)
+        {
+            fopenpanel_symbol(&x->fopenpanel, &s_);
+        }
+        else if (argv[0].a_type == A_SYMBOL)
+        {
+            factorOracle_doread(x, atom_getsymbol(argv));
+        }
+    }
+    else if (s == gensym("write"))
+    {
+        if (argc == 0)
+        {
+            return;
+        }
+        else if (argv[0].a_type == A_SYMBOL)
+        {
+            factorOracle_dowrite(x, atom_getsymbol(argv));
+        }
+    }
+    else if (x->oracle->interner != NULL)
+    {
+        if (argc + 1 > INTERN_EVENT_MAX)
+        {
+            pd_error((t_object *)x, "An event must have 1 to %d elements.", INTERN_EVENT_MAX);
+            return;
+        }
+        t_atom event[INTERN_EVENT_MAX];
+        SETSYMBOL(event, s);
+        memcpy(event + 1, argv, argc * sizeof(t_atom));
+        addEvent(x, event, argc + 1);
+    }
+}
+
+
+
+
+void factorOracle_window(t_factorOracle *x, t_floatarg size)
+{
+    if (!canWrite(x))
+    {
+        return;
+    }
+    if (x->oracle->frame_dim > 0)
+    {
+        pd_error((t_object *)x, "window is not available with -audio.");
+        return;
+    }
+    x->window = (size < 1) ? 0 : (long)size;
+    slideWindow(x);
+}
+
+
+
+
+void factorOracle_truncate(t_factorOracle *x, t_floatarg length)
+{
+    long n = (long)length;
+    if (!canWrite(x))
+    {
+        return;
+    }
+    if (n < 0 || n > x->oracle->input_index)
+    {
+        pd_error((t_object *)x, "Length %ld is outside of the input range [0, %ld].", n, x->oracle->input_index);
+        return;
+    }
+    
+    cancelWindow(x);
+    truncateOracle(x->oracle, n);
+    for (t_factorOracle *u = oracleUsers(x); u != NULL; u = u->next_user)
+    {
+        for (long i = 0; i < u->voice_count; i++)
+        {
+            if (u->voices[i].output_state > n)
+            {
+                u->voices[i].output_state = n;
+            }
+            u->voices[i].jump_pending = 0;
+        }
+        flushSignal(u);
+    }
+}
+
+
+
+
+// Sets the -audio distance under which two frames count as the same symbol, for the input that follows.
+void factorOracle_threshold(t_factorOracle *x, t_floatarg threshold)
+{
+    if (x->oracle->frame_dim == 0)
+    {
+        pd_error((t_object *)x, "threshold needs the -audio flag.");
+        return;
+    }
+    if (canWrite(x))
+    {
+        x->oracle->frame_threshold = (threshold < 0) ? 0 : threshold * threshold;
+    }
+}
+
+
+
+
+void factorOracle_context(t_factorOracle *x, t_floatarg length)
+{
+    x->min_context = (length < 0) ? 0 : (long)length;
+}
+
+
+
+
+void factorOracle_forward(t_factorOracle *x, t_floatarg weight)
+{
+    if (weight < 0)
+    {
+        pd_error((t_object *)x, "Forward weight must not be negative.");
+        return;
+    }
+    x->forward_weight = weight;
+}
+
+
+
+
+void factorOracle_seed(t_factorOracle *x, t_floatarg seed, t_floatarg voice)
+{
+    t_voice *v = voiceAt(x, (long)voice);
+    if (v != NULL)
+    {
+        rng_seed(&v->rng, (uint64_t)(int64_t)seed);
+    }
+}
+
+
+
+
+void factorOracle_probability(t_factorOracle *x, t_floatarg probability, t_floatarg voice)
+{
+    t_voice *v = voiceAt(x, (long)voice);
+    if (v == NULL)
+    {
+        return;
+    }
+    if (probability > 1.0) {
+        v->probability = 1.0;
+    } else if (probability < 0.0) {
+        v->probability = 0;
+    } else {
+        v->probability = probability;
+    }
+}
+
+
+
+
+t_voice *voiceAt(t_factorOracle *x, long voice)
+{
+    if (voice < 0 || voice >= x->voice_count)
+    {
+        pd_error((t_object *)x, "Voice %ld is outside of the voice range [0, %ld).", voice, x->voice_count);
+        return NULL;
+    }
+    return x->voices + voice;
+}
+
+
+
+
+// Sets the number of voices. New voices start unplaced, with the probability of voice 0 and a generator
+// of their own.
+int setVoices(t_factorOracle *x, long count)
+{
+    t_voice *voices = resizebytes(x->voices, x->voice_count * sizeof(t_voice), count * sizeof(t_voice));
+    if (voices == NULL)
+    {
+        return -1;
+    }
+    for (long i = x->voice_count; i < count; i++)
+    {
+        voices[i].output_state = -1;
+        voices[i].jump_pending = 0;
+        voices[i].probability = (i > 0) ? voices[0].probability : 0.75;
+        rng_seed(&voices[i].rng, (uint64_t)time(NULL) ^ ((uint64_t)(uintptr_t)x << 16) ^ ++instance_count);
+    }
+    x->voices = voices;
+    x->voice_count = count;
+    return 0;
+}
+
+
+
+
+void factorOracle_voices(t_factorOracle *x, t_floatarg count)
+{
+    if (count < 1)
+    {
+        pd_error((t_object *)x, "voices needs a number of voices greater than 0.");
+        return;
+    }
+    if (setVoices(x, (long)count) != 0)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+    }
+}
+
+
+
+
+// "step <voice>" moves one voice and outputs its symbol; "step" moves every voice and outputs their
+// symbols as one list, voice 0 first.
+void factorOracle_step(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->oracle->input_index < 1)
+    {
+        post(EMPTY_ORACLE_ERROR);
+        return;
+    }
+    
+    if (argc > 0)
+    {
+        t_voice *v = voiceAt(x, (long)atom_getfloat(argv));
+        if (v == NULL)
+        {
+            return;
+        }
+        outputEvent(x, nextTransition(x, v));
+        return;
+    }
+    
+    t_atom *symbols;
+    long size;
+    takeAtoms(&x->generated, &x->generated_size, &symbols, &size);
+    if (reserveAtoms(&symbols, &size, x->voice_count) != 0)
+    {
+        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        returnAtoms(&x->generated, &x->generated_size, symbols, size);
+        return;
+    }
+    long i;
+    for (i = 0; i < x->voice_count; i++)
+    {
+        SETFLOAT(symbols + i, nextTransition(x, x->voices + i));
+    }
+    outputEvents(x, symbols, i);
+    returnAtoms(&x->generated, &x->generated_size, symbols, size);
+}
+
+
+
+
+// "state <n>" places voice 0 at state n, "state <voice> <n>" places the given voice. "state" followed by
+// field names outputs only those fields of the state of voice 0, and "state" alone outputs all of them.
+void factorOracle_state(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (argc == 0 || argv->a_type == A_SYMBOL)
+    {
+        static const char *names[] = {"inputs", "index", "count", "symbols", "targets", "link"};
+        unsigned fields = (argc == 0) ? STATE_ALL : 0;
+        for (int i = 0; i < argc; i++)
+        {
+            t_symbol *field = atom_getsymbol(argv + i);
+            int k = 0;
+            while (k < 6 && strcmp(field->s_name, names[k]) != 0)
+            {
+                k++;
+            }
+            if (k == 6)
+            {
+                pd_error((t_object *)x, "Unknown state field '%s'.", field->s_name);
+                return;
+            }
+            fields |= 1u << k;
+        }
+        getState(x, fields);
+    }
+    else if (argc == 1)
+    {
+        setState(x, 0, (long)atom_getfloat(argv));
+    }
+    else if (argc >= 2)
+    {
+        setState(x, (long)atom_getfloat(argv), (long)atom_getfloat(argv + 1));
+    }
+}
+
+
+
+
+// The first state on the suffix-link chain of stateIndex that lies more than one state back, or 0.
+// buildOracle() stores it for every state, so this is a single load.
+long jumpBack(t_factorOracle *x, long stateIndex) {
+    return STATE(x->oracle, farLink, stateIndex);
+}
+
+
+
+
+void factorOracle_jumpback(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->oracle->input_index < 1)
+    {
+        post(EMPTY_ORACLE_ERROR);
+        return;
+    }
+    
+    long state_index = (argc > 0) ? (long)atom_getfloat(argv) : x->oracle->input_index;
+    if (state_index < 0 || state_index > x->oracle->input_index)
+    {
+        post("State index %ld is outside of index range [0, %ld].", state_index, x->oracle->input_index);
+        return;
+    }
+    
+    t_atom out[2];
+    SETFLOAT(out, state_index);
+    SETFLOAT(out + 1, jumpBack(x, state_index));
+    outlet_anything(x->m_outlet7, gensym("jumpback"), 2, out);
+}
+
+
+
+
+// Outputs the first count atoms of the x->contexts buffer after selector from the rightmost outlet.
+static void outputReply(t_factorOracle *x, const char *selector, long count)
+{
+    t_atom *atoms;
+    long size;
+    takeAtoms(&x->contexts, &x->contexts_size, &atoms, &size);
+    outlet_anything(x->m_outlet7, gensym(selector), (int)count, atoms);
+    returnAtoms(&x->contexts, &x->contexts_size, atoms, size);
+}
+
+
+
+
+// Appends state to the x->contexts reply buffer, which holds count atoms, and returns the new count.
+static long pushContext(t_factorOracle *x, long count, long state)
+{
+    if (reserveAtoms(&x->contexts, &x->contexts_size, count + 1) != 0)
+    {
+        post("%s", MEMORY_ALLOCATION_ERROR);
+        return -1;
+    }
+    SETFLOAT(x->contexts + count, state);
+    return count + 1;
+}
+
+
+
+
+// Collects into x->contexts the states connected to state by suffix links that each share at least
+// min_length symbols: the subtree, under the highest ancestor reachable through such links, whose every
+// link shares enough. As in OMax this is an approximation: lrs can understate the context two states
+// share, so a few states with enough common context but a weaker link on the way are left out.
+// The tree is walked without a stack through the parent (suffix) links, and because children are sorted
+// by decreasing lrs, no state outside the answer is visited.
+long contexts(t_factorOracle *x, long state, long min_length)
+{
+    if (min_length < 1)
+    {
+        min_length = 1;
+    }
+    long root = state;
+    while (STATE(x->oracle, lrs, root) >= min_length)
+    {
+        root = STATE(x->oracle, suffixLink, root);
+    }
+    
+    long count = 0;
+    long k = root;
+    while (1)
+    {
+        if (k != state && (count = pushContext(x, count, k)) < 0)
         {
-            SETFLOAT(&argv[i], x->states[i].transitionElement);
+            return -1;
+        }
+        
+        long child = STATE(x->oracle, firstChild, k);
+        if (child != -1 && STATE(x->oracle, lrs, child) >= min_length)
+        {
+            k = child;
+            continue;
+        }
+        while (k != root)
+        {
+            long sibling = STATE(x->oracle, nextSibling, k);
+            if (sibling != -1 && STATE(x->oracle, lrs, sibling) >= min_length)
+            {
+                k = sibling;
+                break;
+            }
+            k = STATE(x->oracle, suffixLink, k);
+        }
+        if (k == root)
+        {
+            return count;
         }
-        binbuf_add(b, (int)x->input_index, argv);
-        binbuf_write(b, s->s_name, x->canvas_dir->s_name, 1);
-        freebytes(b, size);
     }
-
 }
 
 
 
 
-void factorOracle_doread(t_factorOracle *x, t_symbol *s) {
-    t_binbuf *b = binbuf_new();
-    int ret = binbuf_read_via_canvas(b, s->s_name, x->canvas, 0);
-    if (ret != 0)
+void factorOracle_contexts(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->oracle->input_index < 1)
     {
-        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        post(EMPTY_ORACLE_ERROR);
         return;
     }
     
-    int num_new_transitions = binbuf_getnatom(b);
-    
-    x->states = resizebytes(x->states, x->input_limit * sizeof(t_state), (x->input_limit + num_new_transitions + 1) * sizeof(t_state));
-    if (x->states == NULL)
+    long state_index = (argc > 0) ? (long)atom_getfloat(argv) : x->voices[0].output_state;
+    long min_length = (argc > 1) ? (long)atom_getfloat(argv + 1) : x->min_context;
+    if (state_index < 0 || state_index > x->oracle->input_index)
     {
-        pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
+        post("State index %ld is outside of index range [0, %ld].", state_index, x->oracle->input_index);
         return;
     }
     
-    long addition_to_input_limit = 0;
-    
-    t_atom *q = binbuf_getvec(b);
-    for (int ac = 0; ac < num_new_transitions; ac++) {
-        if (q[0].a_type == A_FLOAT)
+    long count = contexts(x, state_index, min_length);
+    if (count < 0)
+    {
+        return;
+    }
+    outputReply(x, "contexts", count);
+}
+
+
+
+
+// Whether the input before state ends with the pattern, compared from the end.
+static int endsWith(t_factorOracle *x, long state, const t_atom *pattern, long m)
+{
+    if (state < m)
+    {
+        return 0;
+    }
+    for (long j = m - 1; j >= 0; j--)
+    {
+        if (STATE(x->oracle, symbol, state - m + j) != (long)atom_getfloat(pattern + j))
         {
-            if (buildOracle((long)atom_getfloat(&q[ac]), x) == 0)
-            {
-                x->input_index += 1;
-                addition_to_input_limit += 1;
-            }
-            else
-            {
-                pd_error((t_object *)x, "%s", MEMORY_ALLOCATION_ERROR);
-                return;
-            }
+            return 0;
         }
     }
-    
-    x->input_limit += addition_to_input_limit;
-    freebytes(b, num_new_transitions * sizeof(t_atom));
+    return 1;
 }
 
 
 
 
-void factorOracle_anything(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+// Follows the pattern from state 0 and returns the state it ends in, or -1 if the oracle does not
+// recognise it. O(m) for a pattern of length m. Every factor of the input is recognised, along with some
+// words that are not, and the state reached can lie before the first occurrence. A pattern element that
+// is not a number, or not a symbol the oracle can hold, is not recognised.
+long findPattern(t_factorOracle *x, const t_atom *pattern, long m)
 {
-    if (s == gensym("read"))
+    long k = 0;
+    for (long j = 0; j < m; j++)
     {
-        if (argc == 0)
+        if (pattern[j].a_type != A_FLOAT || !transitionInRange(x->oracle, (long)atom_getfloat(pattern + j)))
         {
-            fopenpanel_symbol(&x->fopenpanel, &s_);
+            return -1;
         }
-        else if (argv[0].a_type == A_SYMBOL)
+        long i = memberOfTransitionElements((long)atom_getfloat(pattern + j), k, x->oracle);
+        if (i == -1)
         {
-            factorOracle_doread(x, atom_getsymbol(argv));
+            return -1;
         }
+        k = transitionEndStates(x->oracle, k)[i];
     }
-    else if (s == gensym("write"))
+    return k;
+}
+
+
+
+
+// Collects into x->contexts every state where the pattern ends, given the state findPattern() reached.
+// All occurrences lie in the suffix-link subtree of that state, but the lrs values along the way can
+// understate what two states share, so the whole subtree is checked against the input rather than pruned
+// as in contexts(). Mismatches are usually found at the first comparison.
+long findOccurrences(t_factorOracle *x, long reached, const t_atom *pattern, long m)
+{
+    long count = 0;
+    long k = reached;
+    while (1)
     {
-        if (argc == 0)
+        if (endsWith(x, k, pattern, m) && (count = pushContext(x, count, k)) < 0)
+        {
+            return -1;
+        }
+        
+        if (STATE(x->oracle, firstChild, k) != -1)
+        {
+            k = STATE(x->oracle, firstChild, k);
+            continue;
+        }
+        while (k != reached && STATE(x->oracle, nextSibling, k) == -1)
         {
+            k = STATE(x->oracle, suffixLink, k);
+        }
+        if (k == reached)
+        {
+            return count;
+        }
+        k = STATE(x->oracle, nextSibling, k);
+    }
+}
+
+
+
+
+static int compareStates(const void *a, const void *b)
+{
+    t_float x = atom_getfloat((t_atom *)a);
+    t_float y = atom_getfloat((t_atom *)b);
+    return (x > y) - (x < y);
+}
+
+
+
+
+// Outputs "find" followed by the states where the pattern ends, in ascending order, or nothing after the
+// selector if it does not occur.
+void factorOracle_find(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->oracle->frame_dim > 0)
+    {
+        pd_error((t_object *)x, "find matches exact symbols, which -audio does not have.");
+        return;
+    }
+    if (x->oracle->input_index < 1)
+    {
+        post(EMPTY_ORACLE_ERROR);
+        return;
+    }
+    if (argc < 1)
+    {
+        post("find needs a pattern of at least one symbol.");
+        return;
+    }
+    
+    // With -intern, each element of the pattern is one event and is looked up as its id; an event that
+    // was never input cannot occur.
+    const t_atom *pattern = argv;
+    t_atom *ids = NULL;
+    long k = 0;
+    if (x->oracle->interner != NULL)
+    {
+        ids = getbytes(argc * sizeof(t_atom));
+        if (ids == NULL)
+        {
+            post("%s", MEMORY_ALLOCATION_ERROR);
             return;
         }
-        else if (argv[0].a_type == A_SYMBOL)
+        for (int i = 0; i < argc && k != -1; i++)
         {
-            factorOracle_dowrite(x, atom_getsymbol(argv));
+            long id = lookupEvent(x->oracle->interner, argv + i, 1);
+            SETFLOAT(ids + i, id);
+            k = (id < 0) ? -1 : 0;
         }
+        pattern = ids;
     }
-    else
+    
+    long count = 0;
+    if (k != -1)
+    {
+        k = findPattern(x, pattern, argc);
+    }
+    if (k != -1)
+    {
+        count = findOccurrences(x, k, pattern, argc);
+    }
+    freebytes(ids, argc * sizeof(t_atom));
+    if (count < 0)
     {
         return;
     }
+    if (count > 1)
+    {
+        qsort(x->contexts, count, sizeof(t_atom), compareStates);
+    }
+    outputReply(x, "find", count);
 }
 
 
 
 
-void factorOracle_probability(t_factorOracle *x, float probability)
+// Outputs "alphabet" followed by the distinct symbols of the input, in order of first appearance.
+void factorOracle_alphabet(t_factorOracle *x)
 {
-    if (probability > 1.0) {
-        x->probability = 1.0;
-    } else if (probability < 0.0) {
-        x->probability = 0;
-    } else {
-        x->probability = probability;
+    t_oracle *o = x->oracle;
+    if (reserveAtoms(&x->contexts, &x->contexts_size, o->alphabet_size) != 0)
+    {
+        post("%s", MEMORY_ALLOCATION_ERROR);
+        return;
+    }
+    for (long i = 0; i < o->alphabet_size; i++)
+    {
+        SETFLOAT(x->contexts + i, o->alphabet[i]);
     }
+    outputReply(x, "alphabet", o->alphabet_size);
 }
 
 
 
 
-long jumpBack(t_factorOracle *x, long stateIndex) {
-    long linkIndex;
-    while (x->states[stateIndex].suffixLink != 0) {
-        linkIndex = x->states[stateIndex].suffixLink;
-        if ((stateIndex - linkIndex) > 1) {
-            return linkIndex;
-        } else {
-            stateIndex = linkIndex;
+// "histogram" outputs "histogram" followed by symbol, count pairs in the order of the alphabet, and
+// "histogram <symbols>" the pairs of the given symbols only. With -intern, the given symbols are events,
+// looked up without being added, and are output as given.
+void factorOracle_histogram(t_factorOracle *x, t_symbol *s, int argc, t_atom *argv)
+{
+    t_oracle *o = x->oracle;
+    long count = (argc > 0) ? argc : o->alphabet_size;
+    if (reserveAtoms(&x->contexts, &x->contexts_size, 2 * count) != 0)
+    {
+        post("%s", MEMORY_ALLOCATION_ERROR);
+        return;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        if (argc == 0)
+        {
+            SETFLOAT(x->contexts + 2 * i, o->alphabet[i]);
+            SETFLOAT(x->contexts + 2 * i + 1, o->alphabet_counts[i]);
+        }
+        else if (o->interner != NULL)
+        {
+            long id = lookupEvent(o->interner, argv + i, 1);
+            x->contexts[2 * i] = argv[i];
+            SETFLOAT(x->contexts + 2 * i + 1, (id < 0) ? 0 : symbolCount(o, id));
+        }
+        else
+        {
+            long transition = (long)atom_getfloat(argv + i);
+            SETFLOAT(x->contexts + 2 * i, transition);
+            SETFLOAT(x->contexts + 2 * i + 1, symbolCount(o, transition));
         }
     }
-    return 0;
+    outputReply(x, "histogram", 2 * count);
 }
 
 
 
 
-long mode_0(t_factorOracle *x) {
-    return factorOracle_walk(x);
+long mode_0(t_factorOracle *x, t_voice *v) {
+    return factorOracle_walk(x, v);
 }
 
 
 
 
-long mode_1(t_factorOracle *x) {
-    return 0;
+// Outputs the symbol that leads out of state and moves to the state after it.
+static long continueFrom(t_factorOracle *x, t_voice *v, long state)
+{
+    v->output_state = state + 1;
+    return STATE(x->oracle, symbol, state);
 }
 
 
 
 
-long mode_2(t_factorOracle *x) {
-    return 0;
+// Context-thresholded walk: follows the original sequence and, with probability 1 - probability,
+// jumps along the suffix link of the current state, but only if the two share at least min_context
+// symbols of context. Only the direct forward transitions are used, so each output continues a context
+// that occurred in the input.
+long mode_1(t_factorOracle *x, t_voice *v) {
+    long s = v->output_state;
+    if ((s == -1) || (s == x->oracle->input_index))
+    {
+        return continueFrom(x, v, jumpBack(x, x->oracle->input_index));
+    }
+    
+    // State 0 has no suffix link to jump along, whatever min_context is.
+    if ((s > 0) && (rng_uniform(&v->rng) >= v->probability) && (STATE(x->oracle, lrs, s) >= x->min_context))
+    {
+        return continueFrom(x, v, STATE(x->oracle, suffixLink, s));
+    }
+    return continueFrom(x, v, s);
+}
+
+
+
+
+// Longest-context walk: like mode 1, but a jump that is due is held back while the context keeps
+// growing along the original sequence, and is taken at the state where the repeated suffix is longest.
+long mode_2(t_factorOracle *x, t_voice *v) {
+    long s = v->output_state;
+    if ((s == -1) || (s == x->oracle->input_index))
+    {
+        v->jump_pending = 0;
+        return continueFrom(x, v, jumpBack(x, x->oracle->input_index));
+    }
+    
+    if (rng_uniform(&v->rng) >= v->probability)
+    {
+        v->jump_pending = 1;
+    }
+    if (v->jump_pending && (s > 0) && (STATE(x->oracle, lrs, s) >= x->min_context) && (STATE(x->oracle, lrs, s) >= STATE(x->oracle, lrs, s + 1)))
+    {
+        v->jump_pending = 0;
+        return continueFrom(x, v, STATE(x->oracle, suffixLink, s));
+    }
+    return continueFrom(x, v, s);
+}
+
+
+
+
+// Picks one of the transitions of state k. Edge 0 of every state but the last is the direct forward
+// transition to k + 1, as buildOracle() adds it when the state is created, so weighting it against the
+// rest takes one extra draw rather than a per-edge table: it is chosen with probability
+// forward_weight / (forward_weight + out-degree - 1), and otherwise an edge is drawn uniformly from the others.
+// That is the only weighting: edges are not weighted by context length, so there is no per-edge table to
+// keep up to date as the oracle grows. Modes 1 and 2 use the lrs for context instead.
+long chooseEdge(t_factorOracle *x, t_voice *v, long k)
+{
+    uint32_t n = (uint32_t)STATE(x->oracle, edgeCount, k);
+    if (n == 1 || x->forward_weight == 1.0)
+    {
+        return rng_below(&v->rng, n);
+    }
+    if (rng_uniform(&v->rng) * (x->forward_weight + n - 1) < x->forward_weight)
+    {
+        return 0;
+    }
+    return 1 + rng_below(&v->rng, n - 1);
 }
 
 
 
 
-long factorOracle_walk(t_factorOracle *x) {
-    if ((x->output_state == -1) || (x->output_state == x->input_index))
+long factorOracle_walk(t_factorOracle *x, t_voice *v) {
+    if ((v->output_state == -1) || (v->output_state == x->oracle->input_index))
     {
-        long suffixState = jumpBack(x, x->input_index);
-        x->output_state = suffixState + 1;
-        return x->states[suffixState].transitionElement;
+        long suffixState = jumpBack(x, x->oracle->input_index);
+        v->output_state = suffixState + 1;
+        return STATE(x->oracle, symbol, suffixState);
     }
     
-    double n = (double)rand() / (double)((unsigned)RAND_MAX + 1);
+    double n = rng_uniform(&v->rng);
     
-    if ((n >= x->probability) && (x->states[x->output_state].suffixLink != 0))
+    // State 0, where a window swap can leave a voice, has no suffix link to jump along.
+    if ((n >= v->probability) && (v->output_state > 0) && (STATE(x->oracle, suffixLink, v->output_state) != 0))
     {
-        long suffixState = x->states[x->output_state].suffixLink;
-        x->output_state = suffixState + 1;
-        return x->states[suffixState].transitionElement;
+        long suffixState = STATE(x->oracle, suffixLink, v->output_state);
+        v->output_state = suffixState + 1;
+        return STATE(x->oracle, symbol, suffixState);
     }
     else
     {
-        double nn = n * x->states[x->output_state].numberOfTransitionElements;
-        for (long i = 0; i <= x->states[x->output_state].numberOfTransitionElements; i++)
+        long i = chooseEdge(x, v, v->output_state);
+        long transition = transitionSymbols(x->oracle, v->output_state)[i];
+        v->output_state = transitionEndStates(x->oracle, v->output_state)[i];
+        return transition;
+    }
+}
+
+
+
+
+static int ring_init(t_ring *r, long size)
+{
+    r->values = getbytes(size * sizeof(t_sample));
+    r->mask = size - 1;
+    r->head = 0;
+    r->tail = 0;
+    return (r->values == NULL) ? -1 : 0;
+}
+
+
+
+
+// Returns 0, or -1 when the ring is full and value is dropped. Called by the producer only.
+static int ring_push(t_ring *r, t_sample value)
+{
+    long head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+    {
+        return -1;
+    }
+    r->values[head & r->mask] = value;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+
+
+// Returns 0 and the oldest value, or -1 when the ring is empty. Called by the consumer only.
+static int ring_pop(t_ring *r, t_sample *value)
+{
+    long tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+    {
+        return -1;
+    }
+    *value = r->values[tail & r->mask];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+
+
+static long ring_count(t_ring *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+
+
+
+static t_signalio *signalio_new(t_factorOracle *x)
+{
+    t_signalio *d = getbytes(sizeof(t_signalio));
+    if (d == NULL)
+    {
+        return NULL;
+    }
+    if (ring_init(&d->input, SIGNAL_INPUT_RING) != 0 || ring_init(&d->output, SIGNAL_OUTPUT_RING) != 0)
+    {
+        freebytes(d->input.values, SIGNAL_INPUT_RING * sizeof(t_sample));
+        freebytes(d->output.values, SIGNAL_OUTPUT_RING * sizeof(t_sample));
+        freebytes(d, sizeof(t_signalio));
+        return NULL;
+    }
+    d->discard = 0;
+    d->blocks = 0;
+    d->last_blocks = 0;
+    d->idle_ticks = 0;
+    d->last_onset = 0;
+    d->last_play = 0;
+    d->current = 0;
+    d->dropped = 0;
+    d->voice.output_state = -1;
+    d->voice.jump_pending = 0;
+    rng_seed(&d->voice.rng, (uint64_t)time(NULL) ^ ((uint64_t)(uintptr_t)d << 16) ^ ++instance_count);
+    d->clock = clock_new(x, (t_method)factorOracle_tilde_tick);
+    return d;
+}
+
+
+
+
+static void signalio_free(t_signalio *d)
+{
+    if (d == NULL)
+    {
+        return;
+    }
+    clock_free(d->clock);
+    freebytes(d->input.values, SIGNAL_INPUT_RING * sizeof(t_sample));
+    freebytes(d->output.values, SIGNAL_OUTPUT_RING * sizeof(t_sample));
+    freebytes(d, sizeof(t_signalio));
+}
+
+
+
+
+// At a rising edge of the onset signal, the input signal is pushed as the next symbol. At a rising edge
+// of the play signal, the next generated symbol is taken and held on the output until the next one. If
+// none is ready, the previous one is held. Symbols generated before the oracle last changed are dropped
+// first.
+static t_int *factorOracle_tilde_perform(t_int *w)
+{
+    t_factorOracle *x = (t_factorOracle *)(w[1]);
+    t_sample *in = (t_sample *)(w[2]);
+    t_sample *onset = (t_sample *)(w[3]);
+    t_sample *play = (t_sample *)(w[4]);
+    t_sample *out = (t_sample *)(w[5]);
+    int n = (int)(w[6]);
+    t_signalio *d = x->dsp;
+    
+    long discard = __atomic_load_n(&d->discard, __ATOMIC_ACQUIRE);
+    if (discard - d->output.tail > 0)
+    {
+        __atomic_store_n(&d->output.tail, discard, __ATOMIC_RELEASE);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        t_sample value = in[i];
+        t_sample o = onset[i];
+        t_sample p = play[i];
+        if (o > 0 && d->last_onset <= 0 && ring_push(&d->input, value) != 0)
         {
-            if (((double)i <= nn) && (nn < ((double)i + 1.0)))
-            {
-                x->output_state = x->states[x->output_state].transitionEndStates[i];
-                break;
-            }
+            __atomic_fetch_add(&d->dropped, 1, __ATOMIC_RELAXED);
+        }
+        if (p > 0 && d->last_play <= 0)
+        {
+            ring_pop(&d->output, &d->current);
         }
-        return x->states[x->output_state - 1].transitionElement;
+        d->last_onset = o;
+        d->last_play = p;
+        out[i] = d->current;
+    }
+    __atomic_store_n(&d->blocks, d->blocks + 1, __ATOMIC_RELAXED);
+    return (w + 7);
+}
+
+
+
+
+void factorOracle_tilde_dsp(t_factorOracle *x, t_signal **sp)
+{
+    dsp_add(factorOracle_tilde_perform, 6, x, sp[0]->s_vec, sp[1]->s_vec, sp[2]->s_vec, sp[3]->s_vec, (t_int)sp[0]->s_n);
+    x->dsp->idle_ticks = 0;
+    clock_delay(x->dsp->clock, SIGNAL_POLL_INTERVAL);
+}
+
+
+
+
+// Runs on the control side: adds the onsets pushed since the last tick, then generates with the signal
+// voice until the output ring is full. The signal voice walks on its own, so bang and step do not
+// interleave with it, and follows the probability of voice 0.
+void factorOracle_tilde_tick(t_factorOracle *x)
+{
+    t_signalio *d = x->dsp;
+    t_sample value;
+    while (ring_pop(&d->input, &value) == 0)
+    {
+        factorOracle_float(x, value);
+    }
+    long dropped = __atomic_exchange_n(&d->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+    {
+        pd_error((t_object *)x, "Dropped %ld onsets: more than %d arrived between two ticks.", dropped, SIGNAL_INPUT_RING);
+    }
+    
+    d->voice.probability = x->voices[0].probability;
+    while (x->oracle->input_index > 0 && ring_count(&d->output) < SIGNAL_OUTPUT_RING)
+    {
+        ring_push(&d->output, (t_sample)nextTransition(x, &d->voice));
+    }
+    
+    long blocks = __atomic_load_n(&d->blocks, __ATOMIC_RELAXED);
+    d->idle_ticks = (blocks == d->last_blocks) ? d->idle_ticks + 1 : 0;
+    d->last_blocks = blocks;
+    if (d->idle_ticks < SIGNAL_IDLE_TICKS)
+    {
+        clock_delay(d->clock, SIGNAL_POLL_INTERVAL);
+    }
+}
+
+
+
+
+// Drops the symbols queued for the signal outlet and restarts the signal voice, after the oracle they
+// were generated from has changed. Only the control side calls this; perform does the dropping.
+static void flushSignal(t_factorOracle *x)
+{
+    t_signalio *d = x->dsp;
+    if (d == NULL)
+    {
+        return;
     }
+    __atomic_store_n(&d->discard, d->output.head, __ATOMIC_RELEASE);
+    d->voice.output_state = -1;
+    d->voice.jump_pending = 0;
 }